@@ -0,0 +1,2180 @@
+/*
+ * librevoco - the protocol side of revoco.
+ *
+ * Device discovery, HID++ register access and argument parsing, shared
+ * by the revoco command and anything else that wants to drive the
+ * receiver from its own event loop.  See revoco.c for the commands.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+#include <linux/types.h>
+#include <linux/input.h>
+#include <linux/hidraw.h>
+
+#include "revoco.h"
+
+#define streq(a,b)	(strcmp((a), (b)) == 0)
+#define strneq(a,b,c)	(strncmp((a), (b), (c)) == 0)
+
+static __thread char errbuf[256];
+
+static int error(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(errbuf, sizeof(errbuf), fmt, args);
+	va_end(args);
+	return -1;
+}
+
+const char *mx_strerror(void)
+{
+	return errbuf;
+}
+
+long long mx_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void print_report(const char *tag, const u8 *rep, int n)
+{
+	int i;
+
+	printf("%s:", tag);
+	for (i = 0; i < n; ++i)
+		printf(" %02x", rep[i]);
+	printf("\n");
+}
+
+/*
+ * Device index (first byte of a HID++ message) of a supported receiver,
+ * 0 if vendor:product is not one of ours.
+ */
+u8 mx_index(short vendor, short product)
+{
+	if (vendor != LOGITECH)
+		return 0;
+
+	switch (product) {
+	case MX_REVOLUTION:
+	case MX_REVOLUTION2:
+	case MX_REVOLUTION3:
+	case MX_REVOLUTION4:
+	case MX_REVOLUTION5:
+		return 1;
+
+	case MX_5500:
+		return 2;
+	}
+	return 0;
+}
+
+static int check_dev(struct mx_dev *dev)
+{
+	struct hidraw_devinfo dinfo;
+
+	if (ioctl(dev->fd, HIDIOCGRAWINFO, &dinfo) == 0)
+	{
+		if (dev->debug > 1)
+			printf("Checking %04hx:%04hx\n",
+			       dinfo.vendor,
+			       dinfo.product);
+
+		dev->idx = mx_index(dinfo.vendor, dinfo.product);
+		if (dev->idx != 0) {
+			dev->product = dinfo.product;
+			if (dev->debug)
+				printf("Found %04hx:%04hx first_byte:%d\n",
+				       dinfo.vendor,
+				       dinfo.product,
+				       dev->idx);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Discovery through sysfs: the HID_ID line of each hidraw node's parent
+ * uevent tells vendor and product, and the report descriptor which of
+ * the receiver's interfaces speaks HID++, so only that node is opened.
+ */
+#define SYS_HIDRAW	"/sys/class/hidraw"
+
+/* The serial number (HID_UNIQ) goes to `uniq' unless that is NULL. */
+static int sys_hid_id(const char *node, short *vendor, short *product,
+		      char *uniq, int n)
+{
+	char buf[512];
+	unsigned bus, v, p;
+	FILE *f;
+	int found = 0;
+
+	snprintf(buf, sizeof(buf), SYS_HIDRAW "/%s/device/uevent", node);
+	f = fopen(buf, "re");
+	if (!f)
+		return 0;
+
+	while (fgets(buf, sizeof(buf), f))
+		if (sscanf(buf, "HID_ID=%x:%x:%x", &bus, &v, &p) == 3) {
+			*vendor = v;
+			*product = p;
+			found = 1;
+			if (!uniq)
+				break;
+		} else if (uniq && strneq(buf, "HID_UNIQ=", 9)) {
+			buf[strcspn(buf, "\n")] = '\0';
+			snprintf(uniq, n, "%.*s", n - 1, buf + 9);
+		}
+	fclose(f);
+	return found;
+}
+
+/*
+ * A receiver has a hidraw node per USB interface, and only one of them
+ * takes HID++ reports.  Returns 1 if the report descriptor of `node'
+ * declares report id 0x10 or 0x11, 0 if it does not, -1 if it cannot
+ * be read.
+ */
+static int sys_hidpp(const char *node)
+{
+	u8 desc[4096];
+	char buf[512];
+	int fd, i, n, size;
+
+	snprintf(buf, sizeof(buf), SYS_HIDRAW "/%s/device/report_descriptor",
+		 node);
+	fd = open(buf, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	n = read(fd, desc, sizeof(desc));
+	close(fd);
+	if (n <= 0)
+		return -1;
+
+	/* short items: tag and size in the prefix; long items: 0xfe, size */
+	for (i = 0; i < n; i += 1 + size) {
+		if (desc[i] == 0xfe) {
+			size = i + 1 < n ? desc[i + 1] + 2 : 0;
+			continue;
+		}
+		size = (desc[i] & 3) == 3 ? 4 : desc[i] & 3;
+		if (desc[i] == 0x85 && i + 1 < n &&
+		    (desc[i + 1] == 0x10 || desc[i + 1] == 0x11))
+			return 1;	/* Report ID (0x10 or 0x11) */
+	}
+	return 0;
+}
+
+/*
+ * Whether `node' (i.e. "hidraw3") is the HID++ interface of a supported
+ * receiver, going by sysfs alone: 1 if it is, 0 if not, -1 if sysfs
+ * does not tell.
+ */
+int mx_check(const char *node)
+{
+	short vendor, product;
+
+	if (!sys_hid_id(node, &vendor, &product, NULL, 0))
+		return -1;
+	return mx_index(vendor, product) != 0 && sys_hidpp(node) != 0;
+}
+
+/* The serial number sysfs has for the receiver, "" if none. */
+int mx_serial(struct mx_dev *dev, char *buf, int n)
+{
+	const char *node = strrchr(dev->path, '/');
+	short vendor, product;
+
+	buf[0] = '\0';
+	return node && sys_hid_id(node + 1, &vendor, &product, buf, n) ? 0 : -1;
+}
+
+static int hidraw_filter(const struct dirent *d)
+{
+	return strneq(d->d_name, "hidraw", 6);
+}
+
+/*
+ * Call found() with the /dev path of the HID++ node of every supported
+ * receiver until it returns non-zero.  Returns -1 if sysfs is not available.
+ */
+int mx_scan(int debug, int (*found)(const char *path, void *arg), void *arg)
+{
+	struct dirent **list;
+	int i, n, stop = 0;
+
+	n = scandir(SYS_HIDRAW, &list, hidraw_filter, versionsort);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		char path[512];
+		short vendor, product;
+
+		if (stop || !sys_hid_id(list[i]->d_name, &vendor, &product,
+					NULL, 0))
+			continue;
+
+		if (debug > 1)
+			printf("Checking %s %04hx:%04hx\n",
+			       list[i]->d_name, vendor, product);
+		if (!mx_index(vendor, product) || !sys_hidpp(list[i]->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), "/dev/%s", list[i]->d_name);
+		stop = found(path, arg);
+	}
+
+	for (i = 0; i < n; ++i)
+		free(list[i]);
+	free(list);
+	return 0;
+}
+
+static void input_report(struct mx_dev *dev, const u8 *rep, int len)
+{
+	++dev->rx_input;
+	if (dev->debug > 2)
+		printf("input report %02x (%d bytes)\n", rep[0], len);
+}
+
+static void notify_report(struct mx_dev *dev, const u8 *rep, int len)
+{
+	++dev->rx_notify;
+	if (dev->debug > 1)
+		printf("notification %02x from device %d\n", rep[2], rep[1]);
+}
+
+void mx_init(struct mx_dev *dev)
+{
+	memset(dev, 0, sizeof(*dev));
+	dev->fd = -1;
+	dev->rec_fd = -1;
+	dev->timeout = 2000;
+	dev->input_handler = input_report;
+	dev->notify_handler = notify_report;
+}
+
+/*
+ * Open `path' into `dev', which keeps its settings (verbosity, timeout,
+ * consumers).  Returns 0 for a supported receiver, -1 if the node cannot
+ * be opened (errno tells why) and -2 if it is something else.
+ */
+int mx_open(struct mx_dev *dev, const char *path)
+{
+	snprintf(dev->path, sizeof(dev->path), "%s", path);
+	dev->srtt = dev->rttvar = 0;
+	dev->ring_head = dev->ring_tail = 0;
+	dev->ninflight = 0;
+	memset(dev->shadow, 0, sizeof(dev->shadow));
+	memset(dev->proto, 0, sizeof(dev->proto));
+	dev->nfeat = dev->feat_loaded = 0;
+
+	dev->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0)
+		return -1;
+	if (check_dev(dev) < 0) {
+		close(dev->fd);
+		dev->fd = -1;
+		return -2;
+	}
+	if (fcntl(dev->fd, F_SETFL, O_RDWR | O_NONBLOCK) == -1)
+		printf("fcntl(O_NONBLOCK): %s\n", strerror(errno));
+	return 0;
+}
+
+struct found {
+	struct mx_dev *dev;
+	int denied;
+	char path[sizeof(((struct mx_dev *)0)->path)];
+};
+
+static int open_found(const char *path, void *arg)
+{
+	struct found *f = arg;
+	int res = mx_open(f->dev, path);
+
+	if (res == -1 && !f->denied && (errno == EACCES || errno == EPERM)) {
+		f->denied = errno;
+		snprintf(f->path, sizeof(f->path), "%s", path);
+	}
+	return res == 0;
+}
+
+/*
+ * Identity cache.  mx_find() remembers the receiver it found in
+ * $XDG_RUNTIME_DIR/revoco.cache as one line
+ *
+ *	SYSFS NODE VENDOR PRODUCT INDEX SERIAL
+ *
+ * where SYSFS is the target of the node's sysfs device link, which
+ * names the HID device instance and so changes whenever the receiver is
+ * plugged in again.  The next run checks that link and opens the node
+ * straight away, without scanning.  Programs that stay around drop the
+ * cache as soon as hidraw nodes come or go, see mx_cache_watch().
+ */
+static int cache_path(char *buf, int n, const char *name)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+
+	if (!dir || !*dir)
+		return -1;
+	snprintf(buf, n, "%s/%s", dir, name);
+	return 0;
+}
+
+static int sys_link(const char *path, char *buf, int n)
+{
+	char link[512];
+	int len;
+
+	snprintf(link, sizeof(link), SYS_HIDRAW "/%s/device",
+		 strrchr(path, '/') + 1);
+	len = readlink(link, buf, n - 1);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+	return 0;
+}
+
+static int cache_lookup(struct mx_dev *dev)
+{
+	char path[512], sys[256], link[256], node[64], uniq[64];
+	unsigned vendor, product, idx;
+	FILE *f;
+	int res;
+
+	if (cache_path(path, sizeof(path), "revoco.cache") < 0)
+		return -1;
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+	res = fscanf(f, "%255s %63s %x %x %u %63s",
+		     sys, node, &vendor, &product, &idx, uniq);
+	fclose(f);
+	if (res != 6 || !strneq(node, "/dev/hidraw", 11))
+		goto stale;
+
+	/* same device instance behind the node, and still ours */
+	if (sys_link(node, link, sizeof(link)) < 0 || !streq(link, sys) ||
+	    mx_open(dev, node) < 0)
+		goto stale;
+	if (dev->product != (short)product || dev->idx != idx) {
+		mx_close(dev);
+		goto stale;
+	}
+	if (dev->debug > 1)
+		printf("Cached %s (serial %s)\n", node, uniq);
+	return 0;
+
+stale:
+	if (dev->debug > 1)
+		printf("Identity cache is stale\n");
+	mx_cache_drop();
+	return -1;
+}
+
+static void cache_store(const struct mx_dev *dev)
+{
+	char path[512], tmp[520], sys[256], uniq[64] = "";
+	short vendor, product;
+	FILE *f;
+
+	if (cache_path(path, sizeof(path), "revoco.cache") < 0 ||
+	    sys_link(dev->path, sys, sizeof(sys)) < 0 ||
+	    !sys_hid_id(strrchr(dev->path, '/') + 1, &vendor, &product,
+			uniq, sizeof(uniq)))
+		return;
+	if (!uniq[0] || strpbrk(uniq, " \t"))
+		strcpy(uniq, "-");
+
+	/* readers see the old file or the new one, never half of it */
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	f = fopen(tmp, "we");
+	if (!f)
+		return;
+	fprintf(f, "%s %s %04hx %04hx %u %s\n", sys, dev->path,
+		vendor, product, dev->idx, uniq);
+	if (fclose(f) != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+void mx_cache_drop(void)
+{
+	char path[512];
+
+	if (cache_path(path, sizeof(path), "revoco.cache") == 0)
+		unlink(path);
+}
+
+/*
+ * Inotify descriptor that becomes readable when nodes appear in or
+ * vanish from /dev; hand it to mx_cache_event() then.
+ */
+int mx_cache_watch(void)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE |
+			      IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Drop the cache if the events pending on `fd' concern a hidraw node.
+ * Returns 1 if it did, 0 if not and -1 on error.
+ */
+int mx_cache_event(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int drop = 0;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->len && strneq(ev->name, "hidraw", 6))
+				drop = 1;
+		}
+	if (len < 0 && errno != EAGAIN && errno != EINTR)
+		return -1;
+	if (drop)
+		mx_cache_drop();
+	return drop;
+}
+
+/*
+ * Find the first supported receiver: the cached one if it is still
+ * there, else through sysfs or, without it, by trying the first few
+ * nodes one by one.  On failure dev->path names a matching node we were
+ * not allowed to open, if there was one; errno is EACCES or EPERM then,
+ * ENODEV otherwise.
+ */
+int mx_find(struct mx_dev *dev)
+{
+	struct found f = { dev, 0 };
+	char buf[128];
+	int i;
+
+	dev->fd = -1;
+	if (cache_lookup(dev) == 0)
+		return 0;
+	if (mx_scan(dev->debug, open_found, &f) == 0) {
+		if (dev->fd >= 0) {
+			cache_store(dev);
+			return 0;
+		}
+		strcpy(dev->path, f.path);
+		errno = f.denied ? f.denied : ENODEV;
+		return -1;
+	}
+
+	for (i = 0; i < 16; ++i) {
+		sprintf(buf, "/dev/hidraw%d", i);
+		if (dev->debug > 1)
+			printf("Trying %s\n", buf);
+		if (mx_open(dev, buf) == 0)
+			return 0;
+	}
+	dev->path[0] = '\0';
+	errno = ENODEV;
+	return -1;
+}
+
+/*
+ * Hotplug: the kernel announces every hidraw node that comes or goes on
+ * a netlink socket, so nothing has to be polled or rescanned.  Poll the
+ * descriptor from mx_hotplug_open() and call mx_hotplug_read() when it
+ * is readable; it returns HP_ADD or HP_REMOVE with the /dev path of the
+ * node, 0 for events about anything else, and -1 on error.
+ */
+int mx_hotplug_open(void)
+{
+	struct sockaddr_nl addr = { AF_NETLINK, 0, 0, 1 };
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int mx_hotplug_read(int fd, char *path, int n)
+{
+	char buf[4096], *p, *end, *name = NULL;
+	struct sockaddr_nl from;
+	socklen_t fromlen = sizeof(from);
+	int action = 0, hidraw = 0;
+	ssize_t len;
+
+	len = recvfrom(fd, buf, sizeof(buf) - 1, 0,
+		       (struct sockaddr *)&from, &fromlen);
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+	/* only the kernel's own messages */
+	if (from.nl_pid != 0)
+		return 0;
+	buf[len] = '\0';
+
+	/* "action@devpath", then KEY=value strings */
+	end = buf + len;
+	for (p = buf + strlen(buf) + 1; p < end; p += strlen(p) + 1) {
+		if (streq(p, "ACTION=add"))
+			action = HP_ADD;
+		else if (streq(p, "ACTION=remove"))
+			action = HP_REMOVE;
+		else if (streq(p, "SUBSYSTEM=hidraw"))
+			hidraw = 1;
+		else if (strneq(p, "DEVNAME=", 8))
+			name = p + 8;
+	}
+	if (!action || !hidraw || !name)
+		return 0;
+	/* DEVNAME is relative to /dev */
+	snprintf(path, n, "%s%s", name[0] == '/' ? "" : "/dev/", name);
+	return action;
+}
+
+void mx_close(struct mx_dev *dev)
+{
+	mx_record_flush(dev);
+	close(dev->fd);
+	dev->fd = -1;
+	dev->ninflight = 0;
+}
+
+int mx_fd(struct mx_dev *dev)
+{
+	return dev->fd;
+}
+
+/* Talk to device `idx' from now on; the shadow was of the previous one. */
+void mx_select(struct mx_dev *dev, u8 idx)
+{
+	if (dev->idx != idx)
+		mx_forget(dev);
+	dev->idx = idx;
+}
+
+/* Forget what the registers hold; someone else may have written them. */
+void mx_forget(struct mx_dev *dev)
+{
+	memset(dev->shadow, 0, sizeof(dev->shadow));
+}
+
+/*
+ * Read the pairing table of a Unifying receiver: register 0xb5 of the
+ * receiver itself (index 0xff) holds the pairing information of slot n
+ * on page 0x1f + n and its name on page 0x3f + n.  An error reply does
+ * not say which page it is about, so the pages are read one at a time,
+ * and names only for the slots that are paired.  Fills
+ * p[0..SLOT_MAX-1] and returns the number of paired devices, or -1 if
+ * the receiver has no such table.
+ */
+static int pairing_page(struct mx_dev *dev, u8 page, struct query *q)
+{
+	memset(q, 0, sizeof(*q));
+	q->idx = 0xff;
+	q->sub = 0x83;
+	q->reg = 0xb5;
+	q->val[0] = page;
+	return mx_query_many(dev, q, 1);
+}
+
+int mx_pairings(struct mx_dev *dev, struct mx_pairing *p)
+{
+	struct query q;
+	int i, n = 0, ok = 0, err = ENOTSUP;
+
+	for (i = 0; i < SLOT_MAX; ++i) {
+		int len;
+
+		memset(&p[i], 0, sizeof(p[i]));
+		p[i].slot = i + 1;
+		if (!pairing_page(dev, 0x20 + i, &q)) {
+			/* a receiver that does not answer will not later on */
+			if (i == 0 && q.state == Q_TIMEOUT) {
+				err = ETIMEDOUT;
+				break;
+			}
+			continue;
+		}
+		++ok;
+		p[i].wpid = q.res[6] << 8 | q.res[7];
+		p[i].kind = q.res[10] & 0x0f;
+		if (!p[i].wpid && !p[i].kind)
+			continue;
+		++n;
+		/* page, length, then as much of the name as fits */
+		if (pairing_page(dev, 0x40 + i, &q)) {
+			len = q.res[4] < REPORT_MAX - 6 ? q.res[4] : REPORT_MAX - 6;
+			memcpy(p[i].name, q.res + 5, len);
+		}
+	}
+	if (!ok) {
+		errno = err;
+		return -1;
+	}
+	return n;
+}
+
+/*
+ * Status segment.  There is a single writer, the daemon; readers retry
+ * until they copied the devices between two equal, even values of the
+ * sequence counter.
+ */
+static void status_name(char *buf, int n)
+{
+	snprintf(buf, n, STATUS_SHM, (unsigned)getuid());
+}
+
+/*
+ * The segment is always created afresh, so that nobody else can hand the
+ * daemon one to write into.  One left behind by a daemon of ours that
+ * died is removed first.
+ */
+struct mx_status *mx_status_create(void)
+{
+	struct mx_status *st;
+	struct stat sb;
+	char name[64];
+	int fd;
+
+	status_name(name, sizeof(name));
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+		if (fd < 0)
+			return NULL;
+		if (fstat(fd, &sb) < 0 || sb.st_uid != getuid()) {
+			close(fd);
+			errno = EEXIST;
+			return NULL;
+		}
+		close(fd);
+		shm_unlink(name);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	}
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, sizeof(*st)) < 0) {
+		close(fd);
+		return NULL;
+	}
+	st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED)
+		return NULL;
+
+	/* a new segment is all zeros: even `seq', no devices */
+	st->magic = STATUS_MAGIC;
+	return st;
+}
+
+void mx_status_publish(struct mx_status *st, int i, const struct mx_status_dev *d)
+{
+	struct timespec ts;
+
+	if (!st || i < 0 || i >= STATUS_MAX)
+		return;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	atomic_fetch_add_explicit(&st->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	st->dev[i] = *d;
+	st->dev[i].updated = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	if (st->n <= i)
+		st->n = i + 1;
+	atomic_fetch_add_explicit(&st->seq, 1, memory_order_release);
+}
+
+void mx_status_remove(struct mx_status *st)
+{
+	char name[64];
+
+	if (!st)
+		return;
+	munmap(st, sizeof(*st));
+	status_name(name, sizeof(name));
+	shm_unlink(name);
+}
+
+/* Map the daemon's segment, if it is one of ours and whole. */
+const struct mx_status *mx_status_open(void)
+{
+	struct mx_status *st;
+	struct stat sb;
+	char name[64];
+	int fd;
+
+	status_name(name, sizeof(name));
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &sb) < 0 || sb.st_uid != getuid() ||
+	    sb.st_size < (off_t)sizeof(*st)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	st = mmap(NULL, sizeof(*st), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (st == MAP_FAILED)
+		return NULL;
+	if (st->magic != STATUS_MAGIC) {
+		munmap(st, sizeof(*st));
+		errno = EINVAL;
+		return NULL;
+	}
+	return st;
+}
+
+#define STATUS_TRIES	100000
+
+/*
+ * Copy up to `n' devices from the segment.  Returns how many there are,
+ * or -1 with errno EAGAIN if the segment stays in the middle of an
+ * update (its writer died there); never blocks, and makes no syscall.
+ */
+int mx_status_read(const struct mx_status *st, struct mx_status_dev *d, int n)
+{
+	struct mx_status *s = (struct mx_status *)st;
+	u32 seq, cnt;
+	int i;
+
+	for (i = 0; i < STATUS_TRIES; ++i) {
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+		cnt = st->n < STATUS_MAX ? st->n : STATUS_MAX;
+		memcpy(d, st->dev, (cnt < n ? cnt : n) * sizeof(*d));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&s->seq, memory_order_relaxed) == seq)
+			return cnt;
+	}
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * Traffic log.  Frames are collected in a buffer allocated up front and
+ * written out when it fills up, on mx_record_flush() and on mx_close(),
+ * so recording costs a memcpy per report and hardly changes the timing.
+ */
+int mx_record(struct mx_dev *dev, const char *path)
+{
+	struct stat st;
+
+	mx_record_stop(dev);
+	dev->rec_buf = malloc(REC_BUF);
+	if (!dev->rec_buf)
+		return -1;
+	dev->rec_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (dev->rec_fd < 0 || fstat(dev->rec_fd, &st) < 0) {
+		mx_record_stop(dev);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		memcpy(dev->rec_buf, REC_MAGIC, REC_MAGIC_LEN);
+		dev->rec_len = REC_MAGIC_LEN;
+	}
+	return 0;
+}
+
+int mx_record_flush(struct mx_dev *dev)
+{
+	int res = 0;
+
+	if (dev->rec_fd >= 0 && dev->rec_len) {
+		if (write(dev->rec_fd, dev->rec_buf, dev->rec_len) != dev->rec_len)
+			res = -1;
+		dev->rec_len = 0;
+	}
+	return res;
+}
+
+void mx_record_stop(struct mx_dev *dev)
+{
+	mx_record_flush(dev);
+	if (dev->rec_fd >= 0)
+		close(dev->rec_fd);
+	free(dev->rec_buf);
+	dev->rec_fd = -1;
+	dev->rec_buf = NULL;
+	dev->rec_len = 0;
+}
+
+static void rec_frame(struct mx_dev *dev, u8 dir, const u8 *rep, int len)
+{
+	long long t = mx_now();
+	u8 *p;
+
+	if (dev->rec_fd < 0 || len <= 0)
+		return;
+	if (len > 255)
+		len = 255;
+	if (dev->rec_len + REC_HDR + len > REC_BUF)
+		mx_record_flush(dev);
+	p = dev->rec_buf + dev->rec_len;
+	memcpy(p, &t, 8);
+	p[8] = dir;
+	p[9] = len;
+	memcpy(p + REC_HDR, rep, len);
+	dev->rec_len += REC_HDR + len;
+}
+
+/* Length of HID++ report `id' including the id, 0 if it is no HID++ one. */
+int mx_report_len(u8 id)
+{
+	return id == 0x10 ? REPORT_SHORT : id == 0x11 ? REPORT_LONG : 0;
+}
+
+/*
+ * Send a report that the caller built in place: `rep' starts with the
+ * report id, `n' counts it.  HID++ reports are zero padded to the
+ * length their id stands for, since hidraw passes them on as given.
+ */
+int mx_send(struct mx_dev *dev, const u8 *rep, int n)
+{
+	u8 buf[REPORT_MAX];
+	int res, len = mx_report_len(rep[0]);
+
+	if (n < len) {
+		memset(buf, 0, len);
+		memcpy(buf, rep, n);
+		rep = buf, n = len;
+	}
+	if (dev->debug > 2)
+		print_report("TX", rep, n);
+
+	res = write(dev->fd, rep, n);
+	++dev->tx;
+	rec_frame(dev, REC_TX, rep, res);
+
+	if (res < 0) {
+		printf("Error: %d\n", errno);
+		perror("send_report");
+	}
+	return res;
+}
+
+/*
+ * Wait up to `wait' microseconds for a report and read it as it comes,
+ * bypassing the receive ring.  Returns its length, 0 on timeout and -1
+ * on error.
+ */
+int mx_recv(struct mx_dev *dev, u8 *buf, int n, long long wait)
+{
+	struct pollfd pfd = { dev->fd, POLLIN, 0 };
+	long long until = mx_now() + wait;
+	int res;
+
+	for (;;) {
+		res = poll(&pfd, 1, wait > 0 ? (wait + 999) / 1000 : 0);
+		if (res > 0 || (res < 0 && errno != EINTR))
+			break;
+		wait = until - mx_now();
+		if (wait <= 0)
+			return 0;
+	}
+	if (res > 0)
+		res = read(dev->fd, buf, n);
+	rec_frame(dev, REC_RX, buf, res);
+	if (dev->debug > 1 && res > 0)
+		print_report("RX", buf, res);
+	if (res < 0) {
+		perror("read");
+	}
+	return res;
+}
+
+/*
+ * Retransmission timeout from the round trip times seen so far, the way
+ * TCP does it (RFC 6298): smoothed RTT plus four times its variation.
+ * Fast receivers fail over quickly, slow radio links get more slack.
+ */
+#define RTO_INIT	200000	/* us, before the first sample */
+#define RTO_MIN		5000
+#define RETRIES		3
+
+static void rtt_sample(struct mx_dev *dev, long long rtt)
+{
+	if (dev->srtt == 0) {
+		dev->srtt = rtt;
+		dev->rttvar = rtt / 2;
+	} else {
+		dev->rttvar = (3 * dev->rttvar + llabs(dev->srtt - rtt)) / 4;
+		dev->srtt = (7 * dev->srtt + rtt) / 8;
+	}
+	if (dev->debug > 2)
+		printf("rtt %lldus, srtt %lldus, rttvar %lldus\n",
+		       rtt, dev->srtt, dev->rttvar);
+}
+
+static long long rto(struct mx_dev *dev)
+{
+	long long t = dev->srtt ? dev->srtt + 4 * dev->rttvar : RTO_INIT;
+
+	if (t < RTO_MIN)
+		t = RTO_MIN;
+	if (t > dev->timeout * 1000LL)
+		t = dev->timeout * 1000LL;
+	return t;
+}
+
+/*
+ * Receive side.  The hidraw node carries ordinary input reports and
+ * HID++ notifications as well as the answers to our requests, so all of
+ * it is drained into a ring of reports first.  HID++ replies (report
+ * 0x10 or 0x11 with a sub-id of 0x80 and up) stay in the ring until
+ * they are matched to a query; notifications and input reports go
+ * straight to their consumers.
+ */
+static int is_hidpp(const u8 *rep, int len)
+{
+	return (rep[0] == 0x10 && len >= 7) || (rep[0] == 0x11 && len >= 20);
+}
+
+static void ring_put(struct mx_dev *dev, const u8 *rep, int len)
+{
+	struct report *r;
+
+	if (dev->ring_head - dev->ring_tail == RING_SIZE) {
+		r = &dev->ring[dev->ring_tail++ % RING_SIZE];
+		if (r->len && dev->debug)
+			print_report("dropped", r->data, r->len);
+	}
+	r = &dev->ring[dev->ring_head++ % RING_SIZE];
+	r->len = len;
+	memcpy(r->data, rep, len);
+}
+
+static struct query *match_query(struct mx_dev *dev, const u8 *rep);
+
+/*
+ * Wait up to `wait' microseconds for the node to become readable, then
+ * read everything that is queued.  Returns the number of HID++ replies
+ * added to the ring, or -1 on error.
+ */
+static int rx_fill(struct mx_dev *dev, long long wait)
+{
+	struct pollfd pfd = { dev->fd, POLLIN, 0 };
+	u8 rep[64];
+	int res, n = 0;
+
+	res = poll(&pfd, 1, wait > 0 ? (wait + 999) / 1000 : 0);
+	if (res <= 0)
+		return res < 0 && errno != EINTR ? -1 : 0;
+	if (pfd.revents & (POLLERR | POLLHUP))
+		return -1;
+
+	while ((res = read(dev->fd, rep, sizeof(rep))) > 0) {
+		++dev->rx;
+		rec_frame(dev, REC_RX, rep, res);
+		if (dev->debug > 1)
+			print_report("RX", rep, res);
+
+		if (!is_hidpp(rep, res))
+			dev->input_handler(dev, rep, res);
+		else if (!(rep[2] & 0x80) && !match_query(dev, rep + 1)) {
+			/*
+			 * A notification: HID++ 2.0 replies look alike, but
+			 * answer a query.  A device that (re)connects may
+			 * have lost its settings.
+			 */
+			if (rep[2] == 0x41)
+				memset(dev->shadow, 0, sizeof(dev->shadow));
+			dev->notify_handler(dev, rep, res);
+		} else {
+			ring_put(dev, rep, res > REPORT_MAX ? REPORT_MAX : res);
+			++n;
+		}
+	}
+	if (res < 0 && errno != EAGAIN && errno != EINTR) {
+		perror("read");
+		return -1;
+	}
+	return n;
+}
+
+int mx_cmd(struct mx_dev *dev, u8 b1, u8 b2, u8 b3)
+{
+	u8 rep[REPORT_SHORT] = { 0x10, dev->idx, 0x80, 0x56, b1, b2, b3 };
+
+	return mx_send(dev, rep, sizeof(rep));
+}
+
+/*
+ * Register access in flight.  Queries are sent as soon as they are
+ * submitted and matched to their replies in whatever order these
+ * arrive, so any number of them can be pipelined.
+ */
+static struct query *match_query(struct mx_dev *dev, const u8 *rep)
+{
+	u8 sub = rep[1], reg = rep[2];
+	int i;
+
+	if (rep[1] == 0x8f || rep[1] == 0xff)
+		sub = rep[2], reg = rep[3];
+
+	/* pages of the pairing table are told apart by their first byte */
+	for (i = 0; i < dev->ninflight; ++i) {
+		struct query *q = dev->inflight[i];
+
+		if (q->idx == rep[0] && q->sub == sub && q->reg == reg &&
+		    (sub != 0x83 || reg != 0xb5 || rep[1] != 0x83 ||
+		     q->val[0] == rep[3]))
+			return q;
+	}
+
+	/* the MX-5500 answers with a different device index */
+	if (rep[0] > 0x02)
+		return NULL;
+	for (i = 0; i < dev->ninflight; ++i) {
+		struct query *q = dev->inflight[i];
+
+		if (q->sub == sub && q->reg == reg)
+			return q;
+	}
+	return NULL;
+}
+
+/* Long register writes, and HID++ 2.0 calls with more than 3 parameters. */
+static int is_long(const struct query *q)
+{
+	static const u8 zero[LONG_VAL - 3];
+
+	return q->sub == 0x82 ||
+	       (q->sub < 0x80 && memcmp(q->val + 3, zero, sizeof(zero)));
+}
+
+static int send_query(struct mx_dev *dev, struct query *q)
+{
+	u8 rep[REPORT_MAX] = { is_long(q) ? 0x11 : 0x10,
+			       q->idx, q->sub, q->reg };
+	long long wait = rto(dev) << q->tries;
+
+	memcpy(rep + 4, q->val, rep[0] == 0x11 ? LONG_VAL : 3);
+	if (mx_send(dev, rep, mx_report_len(rep[0])) < 0)
+		return -1;
+	q->sent = mx_now();
+	q->expires = q->sent + wait;
+	++q->tries;
+	return 0;
+}
+
+static struct shadow *shadow_find(struct shadow *tab, u8 reg)
+{
+	int i;
+
+	for (i = 0; i < SHADOW_MAX; ++i)
+		if (tab[i].valid && tab[i].reg == reg)
+			return &tab[i];
+	return NULL;
+}
+
+/*
+ * Only the wheel register is shadowed: it is what writes get skipped
+ * for, and reads of other registers (a dump) must not crowd it out.
+ */
+static void shadow_set(struct mx_dev *dev, u8 reg, const u8 *val)
+{
+	struct shadow *sh = NULL;
+	int i;
+
+	if (reg != 0x56)
+		return;
+	for (i = 0; i < SHADOW_MAX && !sh; ++i)
+		if (!dev->shadow[i].valid || dev->shadow[i].reg == reg)
+			sh = &dev->shadow[i];
+	if (!sh)
+		return;
+	sh->reg = reg;
+	sh->valid = 1;
+	memcpy(sh->val, val, 3);
+}
+
+/*
+ * Statistics: per kind of command, how many finished which way, and a
+ * histogram of how long the successful ones took.
+ */
+static int stat_kind(const struct query *q)
+{
+	if (q->idx == 0xff && q->sub == 0x80 && q->reg == 0xb2)
+		return S_RECONNECT;
+	return q->sub & 1 ? S_GET : S_SET;
+}
+
+static void stat_add(struct mx_dev *dev, int kind, int state, long long t)
+{
+	struct mx_stat *st = &dev->stat[kind];
+	int i;
+
+	++st->n;
+	if (state == Q_TIMEOUT)
+		++st->timeouts;
+	else if (state != Q_DONE)
+		++st->errors;
+	else {
+		for (i = 0; i < HIST_MAX - 1 && t >> (i + 1); ++i)
+			;
+		++st->hist[i];
+		st->total += t;
+	}
+}
+
+void mx_print_stats(struct mx_dev *dev)
+{
+	static const char *name[S_MAX] = {
+		"set register", "get register", "reconnect", "raw"
+	};
+	int i, j;
+
+	printf("reports: %u sent, %u received (%u input, %u notifications)\n",
+	       dev->tx, dev->rx, dev->rx_input, dev->rx_notify);
+	printf("writes skipped: %u\n", dev->skipped);
+	for (i = 0; i < S_MAX; ++i) {
+		struct mx_stat *st = &dev->stat[i];
+		unsigned ok = st->n - st->errors - st->timeouts;
+
+		if (!st->n)
+			continue;
+		printf("%s: %u, %u bad, %u timed out, %u retries",
+		       name[i], st->n, st->errors, st->timeouts, st->retries);
+		if (ok)
+			printf(", mean %lldus", st->total / ok);
+		printf("\n");
+		for (j = 0; j < HIST_MAX; ++j)
+			if (st->hist[j])
+				printf("  < %8lldus %8u\n", 2LL << j, st->hist[j]);
+	}
+}
+
+/* Take `q' off the in-flight list and tell its owner. */
+static void complete(struct mx_dev *dev, struct query *q, int state)
+{
+	int i;
+
+	for (i = 0; i < dev->ninflight; ++i)
+		if (dev->inflight[i] == q) {
+			memmove(&dev->inflight[i], &dev->inflight[i + 1],
+				(dev->ninflight - i - 1) * sizeof(q));
+			--dev->ninflight;
+			break;
+		}
+	q->state = state;
+	stat_add(dev, stat_kind(q), state, mx_now() - q->start);
+	if (q->done)
+		q->done(dev, q);
+}
+
+void mx_cancel(struct mx_dev *dev, struct query *q)
+{
+	if (q->state == Q_PENDING)
+		complete(dev, q, Q_TIMEOUT);
+}
+
+/*
+ * Hand the replies waiting in the ring to their queries; replies nobody
+ * waits for (any more) are dropped.  Returns how many queries finished.
+ */
+static int take_replies(struct mx_dev *dev)
+{
+	int done = 0;
+
+	for (; dev->ring_tail != dev->ring_head; ++dev->ring_tail) {
+		struct report *r = &dev->ring[dev->ring_tail % RING_SIZE];
+		struct query *q;
+
+		if (!r->len)
+			continue;
+		q = match_query(dev, r->data + 1);
+		if (!q) {
+			if (dev->debug > 1)
+				print_report("stray reply", r->data, r->len);
+			r->len = 0;
+			continue;
+		}
+
+		/* Karn: a retransmitted request gives no usable sample */
+		if (q->tries == 1)
+			rtt_sample(dev, mx_now() - q->sent);
+		q->len = r->len - 1;
+		memcpy(q->res, r->data + 1, q->len);
+		r->len = 0;
+		if (r->data[2] == 0x8f || r->data[2] == 0xff)
+			complete(dev, q, Q_ERROR);
+		else {
+			if (q->idx == dev->idx && q->sub == 0x81)
+				shadow_set(dev, q->reg, q->res + 3);
+			else if (q->idx == dev->idx && q->sub == 0x80)
+				shadow_set(dev, q->reg, q->val);
+			complete(dev, q, Q_DONE);
+		}
+		++done;
+	}
+	return done;
+}
+
+#define SWID		0x0a	/* first HID++ 2.0 software id */
+
+/*
+ * HID++ 2.0 calls to the same function of a feature would all look
+ * alike, so that replies go to them in the order they arrive, which is
+ * not the order they were sent in once one is lost.  Each call in flight
+ * gets a software id of its own (1-15, starting at SWID), which the
+ * reply echoes.
+ */
+static void pick_swid(struct mx_dev *dev, struct query *q)
+{
+	int i, k;
+
+	for (k = 0; k < 15; ++k) {
+		u8 reg = (q->reg & 0xf0) | ((SWID - 1 + k) % 15 + 1);
+
+		for (i = 0; i < dev->ninflight; ++i)
+			if (dev->inflight[i]->idx == q->idx &&
+			    dev->inflight[i]->sub == q->sub &&
+			    dev->inflight[i]->reg == reg)
+				break;
+		if (i == dev->ninflight) {
+			q->reg = reg;
+			return;
+		}
+	}
+}
+
+int mx_submit(struct mx_dev *dev, struct query *q)
+{
+	if (!(q->sub & 0x80))
+		pick_swid(dev, q);
+	q->tries = 0;
+	q->state = Q_ERROR;
+	q->len = 0;
+	memset(q->res, 0, sizeof(q->res));
+
+	if (dev->ninflight == INFLIGHT_MAX) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (send_query(dev, q) < 0) {
+		stat_add(dev, stat_kind(q), Q_ERROR, 0);
+		return -1;
+	}
+	q->start = q->sent;
+	q->deadline = q->sent + dev->timeout * 1000LL;
+	q->state = Q_PENDING;
+	dev->inflight[dev->ninflight++] = q;
+	return 0;
+}
+
+/*
+ * Read whatever the device sent without blocking, complete the queries
+ * it answers, and retry or time out the others.  Requests that are not
+ * answered within the retransmission timeout are sent again, with the
+ * timeout doubled each time, until their deadline passes.  Returns the
+ * number of finished queries, or -1 if the device is gone.
+ */
+int mx_process(struct mx_dev *dev)
+{
+	int i, done, res;
+	long long now;
+
+	res = rx_fill(dev, 0);
+	done = take_replies(dev);
+
+	now = mx_now();
+	for (i = 0; i < dev->ninflight; ) {
+		struct query *q = dev->inflight[i];
+
+		if (now >= q->deadline || res < 0) {
+			complete(dev, q, res < 0 ? Q_ERROR : Q_TIMEOUT);
+			++done;
+			continue;
+		}
+		if (q->expires <= now && q->tries <= RETRIES) {
+			if (dev->debug > 1)
+				printf("Retrying register %02x\n", q->reg);
+			++dev->stat[stat_kind(q)].retries;
+			if (send_query(dev, q) < 0) {
+				complete(dev, q, Q_ERROR);
+				++done;
+				continue;
+			}
+		}
+		++i;
+	}
+	return res < 0 ? -1 : done;
+}
+
+/*
+ * Milliseconds until mx_process() has to run again even if the device
+ * stays silent, -1 if nothing is in flight.
+ */
+int mx_timeout(struct mx_dev *dev)
+{
+	long long wake = -1, t;
+	int i;
+
+	for (i = 0; i < dev->ninflight; ++i) {
+		struct query *q = dev->inflight[i];
+
+		t = q->tries <= RETRIES && q->expires < q->deadline ?
+			q->expires : q->deadline;
+		if (wake < 0 || t < wake)
+			wake = t;
+	}
+	if (wake < 0)
+		return -1;
+	t = wake - mx_now();
+	return t > 0 ? (t + 999) / 1000 : 0;
+}
+
+/*
+ * Block until everything in flight has finished.  Returns -1 if the
+ * device went away meanwhile.
+ */
+int mx_flush(struct mx_dev *dev)
+{
+	while (dev->ninflight) {
+		struct pollfd pfd = { dev->fd, POLLIN, 0 };
+
+		if (poll(&pfd, 1, mx_timeout(dev)) < 0 && errno != EINTR)
+			break;
+		if (mx_process(dev) < 0)
+			return -1;
+	}
+	while (dev->ninflight)
+		complete(dev, dev->inflight[0], Q_ERROR);
+	return 0;
+}
+
+/*
+ * Wait until one of the INFLIGHT_MAX queries in flight finishes, so
+ * that another can be submitted.  Returns -1 if the device went away.
+ */
+static int wait_slot(struct mx_dev *dev)
+{
+	while (dev->ninflight == INFLIGHT_MAX) {
+		struct pollfd pfd = { dev->fd, POLLIN, 0 };
+
+		if (poll(&pfd, 1, mx_timeout(dev)) < 0 && errno != EINTR)
+			return -1;
+		if (mx_process(dev) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Pipelined register access: the requests are sent back to back, at
+ * most INFLIGHT_MAX at a time, and the replies are collected as they
+ * come.  Returns the number of successful ones.
+ */
+int mx_query_many(struct mx_dev *dev, struct query *q, int n)
+{
+	int i, ok = 0;
+
+	for (i = 0; i < n; ++i) {
+		wait_slot(dev);
+		mx_submit(dev, &q[i]);
+	}
+	mx_flush(dev);
+
+	for (i = 0; i < n; ++i)
+		ok += q[i].state == Q_DONE;
+	return ok;
+}
+
+/*
+ * Read one register.  Returns 1 with the reply in `res' (without the
+ * report id), 0 if the device answered with an error (the error reply
+ * is in `res') and -1 on timeout.
+ */
+int mx_query(struct mx_dev *dev, u8 reg, u8 *res)
+{
+	struct query q = { dev->idx, 0x81, reg };
+
+	mx_query_many(dev, &q, 1);
+	memcpy(res, q.res, 6);
+	return q.state == Q_DONE ? 1 : q.state == Q_TIMEOUT ? -1 : 0;
+}
+
+/*
+ * HID++ 2.0.  Newer mice paired to a Unifying receiver have no
+ * registers; each function belongs to a feature, whose index on that
+ * device the root feature (index 0) tells.  The indexes found are kept
+ * per device index, and in $XDG_RUNTIME_DIR/revoco.features as
+ *
+ *	SYSFS INDEX VERSION FEATURE:INDEX...
+ *
+ * for the receiver instance SYSFS (see the identity cache), so that
+ * only the first run on a device pays for the lookups.  A HID++ 1.0
+ * device answers the lookup with error 0x8f, "invalid sub-id", which is
+ * how it is told apart; that is remembered as version 1.  The receiver
+ * answers other 0x8f errors for a device that is asleep or off, which
+ * tell nothing.
+ */
+#define ERR_INVALID_SUBID	0x01	/* HID++ 1.0 error codes */
+
+static struct mx_feature *feat_find(struct mx_dev *dev, u8 idx,
+				    unsigned short id)
+{
+	int i;
+
+	for (i = 0; i < dev->nfeat; ++i)
+		if (dev->feat[i].idx == idx && dev->feat[i].id == id)
+			return &dev->feat[i];
+	return NULL;
+}
+
+static void feat_add(struct mx_dev *dev, u8 idx, unsigned short id, u8 index)
+{
+	struct mx_feature *f = feat_find(dev, idx, id);
+
+	if (!f) {
+		if (dev->nfeat == FEATURE_MAX)
+			return;
+		f = &dev->feat[dev->nfeat++];
+	}
+	f->idx = idx;
+	f->id = id;
+	f->index = index;
+}
+
+static void feat_load(struct mx_dev *dev)
+{
+	char path[512], line[512], sys[256], link[256];
+	unsigned idx, proto, id, index;
+	int off, len;
+	FILE *f;
+	char *p;
+
+	if (dev->feat_loaded)
+		return;
+	dev->feat_loaded = 1;
+	if (cache_path(path, sizeof(path), "revoco.features") < 0 ||
+	    sys_link(dev->path, link, sizeof(link)) < 0)
+		return;
+	f = fopen(path, "re");
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%255s %u %u%n", sys, &idx, &proto, &off) != 3 ||
+		    !streq(sys, link) || idx >= PROTO_MAX || proto > 2)
+			continue;
+		dev->proto[idx] = proto;
+		for (p = line + off; sscanf(p, " %x:%x%n", &id, &index, &len) == 2;
+		     p += len)
+			feat_add(dev, idx, id, index);
+	}
+	fclose(f);
+	if (dev->debug > 1)
+		printf("%d feature indexes cached\n", dev->nfeat);
+}
+
+/* Write back the entries of this receiver, keeping those of others. */
+static void feat_save(struct mx_dev *dev)
+{
+	char path[512], tmp[520], line[512], sys[256], link[256];
+	FILE *in, *out;
+	int i, j;
+
+	if (cache_path(path, sizeof(path), "revoco.features") < 0 ||
+	    sys_link(dev->path, link, sizeof(link)) < 0)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+	out = fopen(tmp, "we");
+	if (!out)
+		return;
+
+	in = fopen(path, "re");
+	while (in && fgets(line, sizeof(line), in))
+		if (sscanf(line, "%255s", sys) == 1 && !streq(sys, link))
+			fputs(line, out);
+	if (in)
+		fclose(in);
+
+	for (i = 0; i < PROTO_MAX; ++i) {
+		if (!dev->proto[i])
+			continue;
+		fprintf(out, "%s %d %d", link, i, dev->proto[i]);
+		for (j = 0; j < dev->nfeat; ++j)
+			if (dev->feat[j].idx == i)
+				fprintf(out, " %04x:%02x", dev->feat[j].id,
+					dev->feat[j].index);
+		fprintf(out, "\n");
+	}
+	if (fclose(out) != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+/* Forget what we knew about a device that no longer matches it. */
+static void feat_forget(struct mx_dev *dev, u8 idx)
+{
+	int i, j;
+
+	if (idx >= PROTO_MAX)
+		return;
+	if (dev->debug)
+		printf("Feature table of device %d is stale\n", idx);
+	dev->proto[idx] = 0;
+	for (i = j = 0; i < dev->nfeat; ++i)
+		if (dev->feat[i].idx != idx)
+			dev->feat[j++] = dev->feat[i];
+	dev->nfeat = j;
+	feat_save(dev);
+}
+
+/*
+ * Look up the features `ids' on device `idx' that are not known yet, all
+ * in one pipelined batch; with n = 0 just find out the version.
+ * Returns the HID++ version of the device, or -1 if it did not answer.
+ * Only Unifying receivers have HID++ 2.0 devices behind them; behind
+ * the others, all are 1.0 without asking.
+ */
+int mx_features(struct mx_dev *dev, u8 idx, const unsigned short *ids, int n)
+{
+	static const unsigned short root = FEAT_ROOT;
+	struct query q[FEATURE_MAX];
+	unsigned short id[FEATURE_MAX];
+	int i, m = 0, proto = 0;
+
+	if (idx >= PROTO_MAX || dev->product != MX_REVOLUTION4)
+		return 1;
+	feat_load(dev);
+	if (dev->proto[idx] == 1)
+		return 1;
+	if (n == 0 && !dev->proto[idx])
+		ids = &root, n = 1;
+
+	for (i = 0; i < n && m < FEATURE_MAX; ++i) {
+		if (feat_find(dev, idx, ids[i]))
+			continue;
+		memset(&q[m], 0, sizeof(q[m]));
+		q[m].idx = idx;
+		q[m].sub = 0x00;		/* root feature */
+		q[m].reg = 0x00 | SWID;		/* getFeature */
+		q[m].val[0] = ids[i] >> 8;
+		q[m].val[1] = ids[i];
+		id[m++] = ids[i];
+	}
+	if (m == 0)
+		return dev->proto[idx];
+
+	mx_query_many(dev, q, m);
+	for (i = 0; i < m; ++i) {
+		if (q[i].state == Q_DONE) {
+			feat_add(dev, idx, id[i], q[i].res[3]);
+			proto = 2;
+		} else if (q[i].state == Q_ERROR && q[i].res[1] == 0x8f &&
+			   q[i].res[4] == ERR_INVALID_SUBID && !proto)
+			proto = 1;
+	}
+	if (proto && dev->debug)
+		printf("Device %d speaks HID++ %d.0\n", idx, proto);
+	if (proto) {
+		dev->proto[idx] = proto;
+		feat_save(dev);
+	}
+	return dev->proto[idx] ? dev->proto[idx] : -1;
+}
+
+/*
+ * Index of feature `id' on device `idx': 0 if the device does not have
+ * it, -1 if mx_features() did not look it up.
+ */
+int mx_feature_index(struct mx_dev *dev, u8 idx, unsigned short id)
+{
+	struct mx_feature *f = feat_find(dev, idx, id);
+
+	return f ? f->index : -1;
+}
+
+/*
+ * A call answered with HID++ 1.0 error "invalid sub-id", or with
+ * "invalid feature index" or "invalid function", went to a device other
+ * than the one the table was made for.  Other 1.0 errors come from the
+ * receiver when the device is out of reach.
+ */
+static void call_failed(struct mx_dev *dev, const struct query *q)
+{
+	if (q->state == Q_ERROR &&
+	    ((q->res[1] == 0x8f && q->res[4] == ERR_INVALID_SUBID) ||
+	     (q->res[1] == 0xff && (q->res[4] == 0x06 || q->res[4] == 0x07))))
+		feat_forget(dev, q->idx);
+}
+
+/*
+ * Call function `func' of feature `id' with `n' bytes of parameters; the
+ * reply, without report id, goes to `res' (REPORT_MAX - 1 bytes).
+ * Returns like mx_query(); -1 with errno ENOTSUP if the device lacks the
+ * feature.
+ */
+int mx_call(struct mx_dev *dev, u8 idx, unsigned short id, u8 func,
+	    const u8 *params, int n, u8 *res)
+{
+	struct query q;
+	int index;
+
+	if (mx_features(dev, idx, &id, 1) != 2 ||
+	    (index = mx_feature_index(dev, idx, id)) <= 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	memset(&q, 0, sizeof(q));
+	q.idx = idx;
+	q.sub = index;
+	q.reg = func << 4 | SWID;
+	memcpy(q.val, params, n < LONG_VAL ? n : LONG_VAL);
+
+	mx_query_many(dev, &q, 1);
+	call_failed(dev, &q);
+	memcpy(res, q.res, sizeof(q.res));
+	return q.state == Q_DONE ? 1 : q.state == Q_TIMEOUT ? -1 : 0;
+}
+
+/*
+ * The wheel, mode and battery verbs on a HID++ 2.0 device: SmartShift
+ * (0x2110) switches between free spinning and ratchet, the latter
+ * disengaging at a given speed, and the battery comes from 0x1000 or
+ * 0x1004.  Only Unifying receivers have such devices behind them.
+ */
+static const unsigned short plan_features[] = {
+	FEAT_BATTERY, FEAT_UNIFIED_BATTERY, FEAT_SMARTSHIFT
+};
+
+/* SmartShift parameters for register 0x56 value `v', -1 if none do. */
+static int smartshift(const u8 *v, u8 *par)
+{
+	int perm = v[0] & 0x80;
+
+	switch (v[0] & 0x0f) {
+	case 1:
+		par[0] = 1;
+		return 0;
+	case 2:
+		par[0] = 2, par[1] = 0xff;
+		break;
+	case 5:
+		par[0] = 2, par[1] = v[1];
+		break;
+	default:
+		return -1;
+	}
+	if (perm)
+		par[2] = par[1];
+	return 0;
+}
+
+static void hidpp20_prepare(struct mx_dev *dev, struct mx_plan *plan,
+			    int first, int last)
+{
+	int i;
+
+	/* the same plan may run on other receivers too */
+	for (i = first; i < last; ++i)
+		plan->step[i].feature = 0;
+	if (dev->product != MX_REVOLUTION4)
+		return;
+
+	for (i = first; i < last; ++i) {
+		struct mx_step *st = &plan->step[i];
+		struct query *c = &st->call;
+		u8 idx = st->idx ? st->idx : dev->idx;
+		int index = 0, func = 0;
+
+		if ((st->verb != V_WHEEL && st->verb != V_MODE &&
+		     st->verb != V_BATTERY) ||
+		    mx_features(dev, idx, plan_features, 3) != 2)
+			continue;
+
+		memset(c, 0, sizeof(*c));
+		st->feature = FEAT_NONE;
+		switch (st->verb) {
+		case V_BATTERY:
+			if ((index = mx_feature_index(dev, idx, FEAT_BATTERY)) > 0)
+				st->feature = FEAT_BATTERY;
+			else if ((index = mx_feature_index(dev, idx,
+					FEAT_UNIFIED_BATTERY)) > 0)
+				st->feature = FEAT_UNIFIED_BATTERY, func = 1;
+			break;
+		case V_MODE:
+			if ((index = mx_feature_index(dev, idx, FEAT_SMARTSHIFT)) > 0)
+				st->feature = FEAT_SMARTSHIFT;
+			break;
+		case V_WHEEL:
+			if ((index = mx_feature_index(dev, idx, FEAT_SMARTSHIFT)) > 0 &&
+			    smartshift(st->q.val, c->val) == 0)
+				st->feature = FEAT_SMARTSHIFT, func = 1;
+			break;
+		}
+		c->idx = idx;
+		c->sub = index;
+		c->reg = func << 4 | SWID;
+		if (st->feature == FEAT_NONE && dev->debug)
+			printf("Device %d has no feature for register %02x\n",
+			       idx, st->q.reg);
+	}
+}
+
+/* register 0x0d state byte for a 0x1000 or 0x1004 charging status */
+static u8 battery_state(unsigned short feature, u8 status)
+{
+	static const u8 status_1000[] = { 0x30, 0x50, 0x50, 0x90, 0x50 };
+	static const u8 status_1004[] = { 0x30, 0x50, 0x50, 0x90 };
+
+	if (feature == FEAT_BATTERY && status < sizeof(status_1000))
+		return status_1000[status];
+	if (feature == FEAT_UNIFIED_BATTERY && status < sizeof(status_1004))
+		return status_1004[status];
+	return 0xd0;
+}
+
+/* Leave the outcome of the call in q, as the register access would have. */
+static void hidpp20_finish(struct mx_dev *dev, struct mx_step *st)
+{
+	const struct query *c = &st->call;
+	struct query *q = &st->q;
+
+	memset(q->res, 0, sizeof(q->res));
+	q->len = 6;
+	q->res[0] = c->idx;
+	q->res[1] = q->sub;
+	q->res[2] = q->reg;
+	q->state = st->feature == FEAT_NONE ? Q_ERROR : c->state;
+
+	if (q->state == Q_ERROR) {
+		q->res[1] = 0x8f;
+		q->res[2] = q->sub;
+		q->res[3] = q->reg;
+		/* "invalid address" if there is nothing to call */
+		q->res[4] = st->feature == FEAT_NONE ? 0x02 : c->res[4];
+		call_failed(dev, c);
+		return;
+	}
+	if (q->state != Q_DONE)
+		return;
+
+	switch (st->feature) {
+	case FEAT_BATTERY:
+	case FEAT_UNIFIED_BATTERY:
+		q->res[3] = c->res[3];
+		q->res[5] = battery_state(st->feature, c->res[5]);
+		break;
+	case FEAT_SMARTSHIFT:
+		if (st->verb == V_MODE)
+			q->res[5] = c->res[3] == 2;
+		break;
+	}
+}
+
+static const char *onearg(const char *str, char prefix, u8 *arg, int def, int min, int max)
+{
+	char *end;
+	long n;
+
+	*arg = def;
+
+	if (*str == '\0')
+		return str;
+
+	if (*str != prefix) {
+		error("bad argument `%s': `%c' expected", str, prefix);
+		return NULL;
+	}
+
+	n = strtol(++str, &end, 0);
+	if (str != end)
+	{
+		*arg = n;
+		if (n < min || n > max) {
+			error("argument `%.*s' out of range (%d-%d)", (int)(end - str), str, min, max);
+			return NULL;
+		}
+	}
+	return end;
+}
+
+int mx_twoargs(const char *str, u8 *arg1, u8 *arg2, int def, int min, int max)
+{
+	const char *p = str;
+
+	if (!(p = onearg(p, '=', arg1, def, min, max)) ||
+	    !(p = onearg(p, ',', arg2, *arg1, min, max)))
+		return -1;
+	if (*p)
+		return error("malformed argument `%s'", str);
+	return 0;
+}
+
+int mx_nargs(const char *str, u8 *buf, int n, int def, int min, int max)
+{
+	const char *p = str;
+	int i = 0, del = '=';
+
+	while (n--)
+	{
+		if (*p)
+			i++;
+		if (!(p = onearg(p, del, buf++, def, min, max)))
+			return -1;
+		del = ',';
+	}
+	if (*p)
+		return error("malformed argument `%s'", str);
+	return i;
+}
+
+/*
+ * Command plans.  The whole command line is parsed and checked first;
+ * only then are the steps sent, consecutive register accesses back to
+ * back with a single wait for all the answers.
+ */
+static struct mx_step *plan_add(struct mx_plan *plan, u8 verb)
+{
+	struct mx_step *st;
+
+	if (plan->n == plan->size) {
+		int size = plan->size * 2 + 8;
+
+		st = realloc(plan->step, size * sizeof(*st));
+		if (!st) {
+			error("out of memory");
+			return NULL;
+		}
+		plan->step = st;
+		plan->size = size;
+	}
+	st = &plan->step[plan->n++];
+	memset(st, 0, sizeof(*st));
+	st->verb = verb;
+	return st;
+}
+
+static struct mx_step *plan_reg(struct mx_plan *plan, u8 verb, u8 sub, u8 reg,
+				u8 v1, u8 v2, u8 v3)
+{
+	struct mx_step *st = plan_add(plan, verb);
+
+	if (st) {
+		st->q.sub = sub;
+		st->q.reg = reg;
+		st->q.val[0] = v1;
+		st->q.val[1] = v2;
+		st->q.val[2] = v3;
+	}
+	return st;
+}
+
+static int compile_verb(struct mx_plan *plan, char *verb)
+{
+	u8 perm = 0x80, arg1, arg2;
+	char *cmd = verb;
+
+	if (strneq(cmd, "temp-", 5))
+		perm = 0, cmd += 5;
+
+	if (streq(cmd, "free"))
+		return plan_reg(plan, V_WHEEL, 0x80, 0x56, perm + 1, 0, 0) ? 0 : -1;
+	if (streq(cmd, "click"))
+		return plan_reg(plan, V_WHEEL, 0x80, 0x56, perm + 2, 0, 0) ? 0 : -1;
+	if (strneq(cmd, "manual", 6)) {
+		if (mx_twoargs(cmd + 6, &arg1, &arg2, 0, 0, 15) < 0)
+			return -1;
+		if (arg1 != arg2)
+			return plan_reg(plan, V_WHEEL, 0x80, 0x56,
+					perm + 7, arg1 * 16 + arg2, 0) ? 0 : -1;
+		return plan_reg(plan, V_WHEEL, 0x80, 0x56,
+				perm + 8, arg1, 0) ? 0 : -1;
+	}
+	if (strneq(cmd, "auto", 4)) {
+		if (mx_twoargs(cmd + 4, &arg1, &arg2, 0, 0, 50) < 0)
+			return -1;
+		return plan_reg(plan, V_WHEEL, 0x80, 0x56,
+				perm + 5, arg1, arg2) ? 0 : -1;
+	}
+	if (strneq(verb, "soft-free", 9)) {
+		if (mx_twoargs(verb + 9, &arg1, &arg2, 0, 0, 255) < 0)
+			return -1;
+		return plan_reg(plan, V_WHEEL, 0x80, 0x56, 3, arg1, arg2) ? 0 : -1;
+	}
+	if (strneq(verb, "soft-click", 10)) {
+		if (mx_twoargs(verb + 10, &arg1, &arg2, 0, 0, 255) < 0)
+			return -1;
+		return plan_reg(plan, V_WHEEL, 0x80, 0x56, 4, arg1, arg2) ? 0 : -1;
+	}
+	if (strneq(verb, "reconnect", 9)) {
+		struct mx_step *st;
+
+		if (mx_twoargs(verb + 9, &arg1, &arg2, 0, 0, 255) < 0)
+			return -1;
+		/* addressed to the receiver itself */
+		st = plan_reg(plan, V_RECONNECT, 0x80, 0xb2, 1, 0, 0);
+		if (st)
+			st->idx = 0xff;
+		return st ? 0 : -1;
+	}
+	if (strneq(verb, "mode", 4))
+		return plan_reg(plan, V_MODE, 0x81, 0x08, 0, 0, 0) ? 0 : -1;
+	if (strneq(verb, "battery", 7))
+		return plan_reg(plan, V_BATTERY, 0x81, 0x0d, 0, 0, 0) ? 0 : -1;
+
+	/*** debug commands ***/
+	if (strneq(verb, "raw", 3)) {
+		u8 buf[RAW_MAX];
+		struct mx_step *st;
+		int n = mx_nargs(verb + 3, buf, RAW_MAX, 0, 0, 255);
+
+		if (n > 0 && mx_report_len(buf[0]) && n > mx_report_len(buf[0]))
+			return error("report %02x has only %d bytes", buf[0],
+				     mx_report_len(buf[0]));
+		if (n < 0 || !(st = plan_add(plan, V_RAW)))
+			return -1;
+		memcpy(st->data, buf, n);
+		st->len = n;
+		return 0;
+	}
+	if (strneq(verb, "dump", 4)) {
+		u8 regs[DUMP_MAX], sub = 0x81;
+		int i, n;
+
+		/* long registers, 16 bytes each */
+		if (strneq(verb, "dump-long", 9))
+			sub = 0x83, verb += 5;
+		n = mx_nargs(verb + 4, regs, DUMP_MAX, 0, 0, 255);
+		if (n < 0)
+			return -1;
+		if (n == 0 && sub == 0x83)
+			return error("dump-long needs the registers to read");
+		if (n == 0)
+			regs[0] = 0x08, regs[1] = 0x0d, n = 2;
+		for (i = 0; i < n; ++i)
+			if (!plan_reg(plan, V_DUMP, sub, regs[i], 0, 0, 0))
+				return -1;
+		return 0;
+	}
+	if (strneq(verb, "query", 5)) {
+		struct mx_step *st;
+
+		if (mx_twoargs(verb + 5, &arg1, &arg2, 0, 0, 255) < 0 ||
+		    !(st = plan_add(plan, V_RECV)))
+			return -1;
+		if (verb[5] == '\0')
+			arg1 = 0x10;
+		/* the length follows from a HID++ report id */
+		if (!strchr(verb, ',') && mx_report_len(arg1))
+			arg2 = mx_report_len(arg1) - 1;
+		if (arg2 >= RAW_MAX)
+			return error("report length %d too long", arg2);
+		st->arg = arg1;
+		st->len = arg2;
+		return 0;
+	}
+	if (streq(verb, "stats"))
+		return plan_add(plan, V_STATS) ? 0 : -1;
+	if (streq(verb, "list"))
+		return plan_add(plan, V_LIST) ? 0 : -1;
+	if (strneq(verb, "sleep", 5)) {
+		struct mx_step *st;
+
+		if (mx_twoargs(verb + 5, &arg1, &arg2, 1, 0, 255) < 0 ||
+		    !(st = plan_add(plan, V_SLEEP)))
+			return -1;
+		st->arg = arg1;
+		return 0;
+	}
+	return error("unknown option `%s'", verb);
+}
+
+/*
+ * Compile the verbs argv[1..argc-1].  Returns -1 with the reason in
+ * mx_strerror() if any of them is bad.
+ */
+int mx_plan_compile(struct mx_plan *plan, int argc, char **argv)
+{
+	int i;
+
+	memset(plan, 0, sizeof(*plan));
+	for (i = 1; i < argc; ++i)
+		if (compile_verb(plan, argv[i]) < 0) {
+			mx_plan_free(plan);
+			return -1;
+		}
+	return 0;
+}
+
+void mx_plan_free(struct mx_plan *plan)
+{
+	free(plan->step);
+	memset(plan, 0, sizeof(*plan));
+}
+
+static int batched(const struct mx_step *st)
+{
+	return st->verb != V_RECV && st->verb != V_SLEEP &&
+	       st->verb != V_STATS && st->verb != V_LIST;
+}
+
+/*
+ * Read the wheel registers the batch is about to write and that are not
+ * in the shadow yet, so that writes of what is already there can be
+ * left out.
+ */
+static void read_shadow(struct mx_dev *dev, struct mx_plan *plan,
+			int first, int last)
+{
+	struct query rd[SHADOW_MAX];
+	int i, j, n = 0;
+
+	for (i = first; i < last; ++i) {
+		struct mx_step *st = &plan->step[i];
+
+		if (st->verb != V_WHEEL || st->feature ||
+		    shadow_find(dev->shadow, st->q.reg))
+			continue;
+		for (j = 0; j < n && rd[j].reg != st->q.reg; ++j)
+			;
+		if (j < n || n == SHADOW_MAX)
+			continue;
+		memset(&rd[n], 0, sizeof(rd[n]));
+		rd[n].idx = dev->idx;
+		rd[n].sub = 0x81;
+		rd[n].reg = st->q.reg;
+		++n;
+	}
+	if (n)
+		mx_query_many(dev, rd, n);
+}
+
+/*
+ * Run the steps from `first' on up to the next one that has to wait on
+ * its own (sleep, reading a raw report).  Returns the index of the first
+ * step not run yet; the results are left in the steps.
+ *
+ * Wheel settings the device already has are not written again, unless
+ * dev->force is set: a run that changes nothing costs a read of the
+ * register, or nothing at all once it is in the shadow.
+ */
+int mx_plan_run(struct mx_dev *dev, struct mx_plan *plan, int first)
+{
+	struct mx_step *st = &plan->step[first];
+	struct shadow want[SHADOW_MAX], *sh;
+	int i, last;
+
+	/* statistics and the pairing table are for the caller to print */
+	if (st->verb == V_SLEEP || st->verb == V_STATS || st->verb == V_LIST) {
+		if (st->verb == V_SLEEP)
+			sleep(st->arg);
+		st->q.state = Q_DONE;
+		return first + 1;
+	}
+	if (st->verb == V_RECV) {
+		long long until = mx_now() + dev->timeout * 1000LL;
+		int res;
+
+		/* reports of other ids are not the one asked for */
+		do
+			res = mx_recv(dev, st->data, st->len + 1,
+				      until - mx_now());
+		while (res > 0 && st->data[0] != st->arg);
+
+		st->q.state = res > 0 ? Q_DONE : res == 0 ? Q_TIMEOUT : Q_ERROR;
+		return first + 1;
+	}
+
+	for (last = first; last < plan->n && batched(&plan->step[last]); ++last)
+		;
+	hidpp20_prepare(dev, plan, first, last);
+	if (!dev->force)
+		read_shadow(dev, plan, first, last);
+	/* what the registers hold once the writes sent so far are done */
+	memcpy(want, dev->shadow, sizeof(want));
+
+	for (i = first; i < last; ++i) {
+		st = &plan->step[i];
+		if (st->verb == V_RAW) {
+			/* may have written anything */
+			memset(dev->shadow, 0, sizeof(dev->shadow));
+			memset(want, 0, sizeof(want));
+			st->q.start = mx_now();
+			st->q.state = mx_send(dev, st->data, st->len) < 0 ?
+				Q_ERROR : Q_DONE;
+			stat_add(dev, S_RAW, st->q.state,
+				 mx_now() - st->q.start);
+			continue;
+		}
+		st->q.idx = st->idx ? st->idx : dev->idx;
+		if (st->feature) {
+			if (st->feature != FEAT_NONE) {
+				wait_slot(dev);
+				mx_submit(dev, &st->call);
+			}
+			continue;
+		}
+		if (st->verb == V_WHEEL && !dev->force &&
+		    (sh = shadow_find(want, st->q.reg))) {
+			if (!memcmp(sh->val, st->q.val, 3)) {
+				if (dev->debug > 1)
+					printf("Register %02x already set\n",
+					       st->q.reg);
+				++dev->skipped;
+				st->q.state = Q_DONE;
+				continue;
+			}
+			memcpy(sh->val, st->q.val, 3);
+		}
+		wait_slot(dev);
+		mx_submit(dev, &st->q);
+	}
+	mx_flush(dev);
+
+	/* a write that was not acknowledged leaves the register unknown */
+	for (i = first; i < last; ++i) {
+		st = &plan->step[i];
+		if (st->feature) {
+			hidpp20_finish(dev, st);
+			continue;
+		}
+		if (st->q.sub == 0x80 && st->q.state != Q_DONE &&
+		    (sh = shadow_find(dev->shadow, st->q.reg)))
+			sh->valid = 0;
+	}
+	return last;
+}
@@ -0,0 +1,381 @@
+/*
+ * revoco-bench - measure where revoco spends its time.
+ *
+ * Runs each step many times against a receiver and prints the median,
+ * 99th percentile and worst case:
+ *
+ *   cold start	running `revoco -d NODE mode' from exec to exit
+ *   discovery	scanning all hidraw nodes for receivers (mx_scan)
+ *   find+open	mx_find(), i.e. the identity cache (or discovery) plus
+ *		opening the receiver
+ *   set		one acknowledged wheel mode write
+ *   query		one register read (battery)
+ *   batch		BATCH pipelined register reads
+ *
+ * Without -d the receiver is looked for as revoco does; with --sim=N
+ * that many revoco-sim instances are started first and the first one is
+ * used, so it runs on any box with /dev/uhid.  The set step writes the
+ * wheel mode the mouse already has (register 0x56), as a temporary
+ * setting, and is left out if that cannot be read.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include "revoco.h"
+
+#define BATCH		8
+#define SIM_MAX		32
+
+static int debug = 0;
+static int iterations = 1000;
+static char *revoco = "./revoco";
+static char *sim = "./revoco-sim";
+
+static pid_t sims[SIM_MAX];
+static int nsims;
+
+static void stop_sims(void);
+
+static void fatal(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(stderr, "revoco-bench: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+	stop_sims();
+	exit(1);
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print percentiles of `n' samples in microseconds; sorts them. */
+static void report(const char *name, long long *t, int n, int failed)
+{
+	if (n == 0) {
+		printf("%-12s %8s %8s %8s   no samples\n", name, "-", "-", "-");
+		return;
+	}
+	qsort(t, n, sizeof(*t), cmp_ll);
+	printf("%-12s %8lld %8lld %8lld   %d runs",
+	       name, t[n / 2], t[(n * 99) / 100], t[n - 1], n);
+	if (failed)
+		printf(", %d failed", failed);
+	printf("\n");
+}
+
+static int count_nodes(void)
+{
+	struct dirent *de;
+	int n = 0;
+	DIR *dir;
+
+	dir = opendir("/sys/class/hidraw");
+	if (!dir)
+		return -1;
+	while ((de = readdir(dir)))
+		n += strncmp(de->d_name, "hidraw", 6) == 0;
+	closedir(dir);
+	return n;
+}
+
+/* Start a simulator and return the hidraw node it prints. */
+static char *start_sim(const char *args)
+{
+	char line[256], *cmd;
+	FILE *f;
+	int p[2];
+	pid_t pid;
+
+	if (nsims == SIM_MAX)
+		fatal("too many simulators");
+	if (pipe(p) < 0)
+		fatal("pipe: %s", strerror(errno));
+	pid = fork();
+	if (pid < 0)
+		fatal("fork: %s", strerror(errno));
+	if (pid == 0) {
+		dup2(p[1], 1);
+		close(p[0]);
+		close(p[1]);
+		if (asprintf(&cmd, "exec %s %s", sim, args ? args : "") < 0)
+			exit(1);
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		exit(1);
+	}
+	close(p[1]);
+	sims[nsims++] = pid;
+
+	f = fdopen(p[0], "r");
+	if (!f)
+		fatal("fdopen: %s", strerror(errno));
+	while (fgets(line, sizeof(line), f))
+		if (strncmp(line, "/dev/", 5) == 0) {
+			fclose(f);
+			line[strcspn(line, "\n")] = '\0';
+			return strdup(line);
+		}
+	fatal("%s did not start", sim);
+	return NULL;
+}
+
+static void stop_sims(void)
+{
+	while (nsims > 0) {
+		--nsims;
+		kill(sims[nsims], SIGTERM);
+		waitpid(sims[nsims], NULL, 0);
+	}
+}
+
+static int ignore(const char *path, void *arg)
+{
+	++*(int *)arg;
+	return 0;
+}
+
+static void bench_cold(const char *path, long long *t)
+{
+	int i, n = 0, failed = 0, runs = iterations / 10 ? iterations / 10 : 1;
+
+	for (i = 0; i < runs; ++i) {
+		long long start = mx_now();
+		int st;
+		pid_t pid = fork();
+
+		if (pid < 0)
+			fatal("fork: %s", strerror(errno));
+		if (pid == 0) {
+			int null = open("/dev/null", O_WRONLY);
+
+			dup2(null, 1);
+			execl(revoco, revoco, "-d", path, "mode", (char *)NULL);
+			exit(127);
+		}
+		if (waitpid(pid, &st, 0) < 0 || !WIFEXITED(st) ||
+		    WEXITSTATUS(st)) {
+			++failed;
+			if (WIFEXITED(st) && WEXITSTATUS(st) == 127)
+				fatal("cannot run %s", revoco);
+			continue;
+		}
+		t[n++] = mx_now() - start;
+	}
+	report("cold start", t, n, failed);
+}
+
+static void bench_discovery(long long *t)
+{
+	struct mx_dev probe;
+	int i, found = 0, n = 0, failed = 0;
+
+	for (i = 0; i < iterations; ++i) {
+		long long start = mx_now();
+
+		if (mx_scan(0, ignore, &found) < 0) {
+			++failed;
+			continue;
+		}
+		t[n++] = mx_now() - start;
+	}
+	printf("%-12s %d hidraw nodes, %d receivers\n", "",
+	       count_nodes(), n ? found / n : 0);
+	report("discovery", t, n, failed);
+
+	n = failed = 0;
+	for (i = 0; i < iterations; ++i) {
+		long long start = mx_now();
+
+		mx_init(&probe);
+		if (mx_find(&probe) < 0) {
+			++failed;
+			continue;
+		}
+		t[n++] = mx_now() - start;
+		mx_close(&probe);
+	}
+	report("find+open", t, n, failed);
+}
+
+static void bench_queries(struct mx_dev *dev, long long *t)
+{
+	struct query q[BATCH];
+	u8 res[6], val[3];
+	int i, j, n = 0, failed = 0, iterations_set = iterations;
+
+	/*
+	 * Write back what is there, but only temporarily; without knowing
+	 * what that is, leave the mouse alone.
+	 */
+	if (mx_query(dev, 0x56, res) == 1) {
+		memcpy(val, res + 3, 3);
+		val[0] &= 0x7f;
+	} else
+		iterations_set = 0;
+
+	for (i = 0; i < iterations_set; ++i) {
+		struct query w = { dev->idx, 0x80, 0x56,
+				   { val[0], val[1], val[2] } };
+		long long start = mx_now();
+
+		if (mx_query_many(dev, &w, 1) != 1) {
+			++failed;
+			continue;
+		}
+		t[n++] = mx_now() - start;
+	}
+	if (iterations_set)
+		report("set", t, n, failed);
+	else
+		printf("%-12s %8s %8s %8s   register 0x56 unreadable, "
+		       "skipped\n", "set", "-", "-", "-");
+
+	n = failed = 0;
+	for (i = 0; i < iterations; ++i) {
+		long long start = mx_now();
+
+		if (mx_query(dev, 0x0d, res) != 1) {
+			++failed;
+			continue;
+		}
+		t[n++] = mx_now() - start;
+	}
+	report("query", t, n, failed);
+
+	n = failed = 0;
+	for (i = 0; i < iterations; ++i) {
+		long long start;
+
+		memset(q, 0, sizeof(q));
+		for (j = 0; j < BATCH; ++j) {
+			q[j].idx = dev->idx;
+			q[j].sub = 0x81;
+			q[j].reg = j & 1 ? 0x0d : 0x08;
+		}
+		start = mx_now();
+		if (mx_query_many(dev, q, BATCH) != BATCH) {
+			++failed;
+			continue;
+		}
+		t[n++] = mx_now() - start;
+	}
+	report("batch", t, n, failed);
+}
+
+static void usage(void)
+{
+	printf("revoco-bench - measure revoco's latencies\n\n");
+	printf("Usage: revoco-bench [options]\n\n");
+	printf("Options:\n");
+	printf("  -d, --device=PATH    use this hidraw node\n");
+	printf("  -n, --iterations=N   runs per step (default 1000)\n");
+	printf("  -s, --sim=N          start N simulated receivers and use the first\n");
+	printf("  -S, --sim-args=ARGS  options for revoco-sim, i.e. \"-l 2000\"\n");
+	printf("  -t, --timeout=MS     per command timeout (default 2000)\n");
+	printf("  -v, --verbose        more output\n");
+	printf("\n");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+	    {"help",	   no_argument,		0, 'h'},
+	    {"device",	   required_argument,	0, 'd'},
+	    {"iterations", required_argument,	0, 'n'},
+	    {"sim",	   required_argument,	0, 's'},
+	    {"sim-args",   required_argument,	0, 'S'},
+	    {"timeout",	   required_argument,	0, 't'},
+	    {"verbose",	   no_argument,		0, 'v'},
+	    {0,		   0,			0, 0}
+	};
+	struct mx_dev dev;
+	char *path = NULL, *sim_args = NULL;
+	int opt, i, nsim = 0, timeout = 2000;
+	long long *t;
+
+	while ((opt = getopt_long(argc, argv, "d:hn:s:S:t:v",
+				  long_options, NULL)) >= 0) {
+		switch (opt) {
+		case 'd':
+			path = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			nsim = atoi(optarg);
+			break;
+		case 'S':
+			sim_args = optarg;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		case 'v':
+			++debug;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (iterations <= 0 || nsim < 0 || nsim > SIM_MAX || timeout <= 0)
+		fatal("bad argument");
+	if (getenv("REVOCO"))
+		revoco = getenv("REVOCO");
+	if (getenv("REVOCO_SIM"))
+		sim = getenv("REVOCO_SIM");
+
+	for (i = 0; i < nsim; ++i) {
+		char *node = start_sim(sim_args);
+
+		if (debug)
+			printf("simulator on %s\n", node);
+		if (!path)
+			path = node;
+	}
+
+	mx_init(&dev);
+	dev.debug = debug;
+	dev.timeout = timeout;
+	if (path ? mx_open(&dev, path) < 0 : mx_find(&dev) < 0)
+		fatal("no receiver%s%s: %s", path ? " on " : "",
+		      path ? path : "", strerror(errno));
+	path = dev.path;
+
+	t = calloc(iterations, sizeof(*t));
+	if (!t)
+		fatal("out of memory");
+
+	printf("%s, %d iterations\n\n", path, iterations);
+	printf("%-12s %8s %8s %8s   (microseconds)\n", "", "p50", "p99", "max");
+	bench_cold(path, t);
+	bench_discovery(t);
+	bench_queries(&dev, t);
+	printf("\nrtt estimate %lldus, %u reports sent, %u received\n",
+	       dev.srtt, dev.tx, dev.rx);
+
+	mx_close(&dev);
+	free(t);
+	stop_sims();
+	return 0;
+}
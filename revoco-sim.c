@@ -0,0 +1,611 @@
+/*
+ * revoco-sim - a virtual MX-Revolution receiver for testing revoco.
+ *
+ * Creates a HID device through /dev/uhid with the report descriptor of
+ * the receiver's second interface (see mx-revo-full-lsusb.txt) and
+ * answers the HID++ register commands documented in revoco.c, so that
+ * revoco can be run and measured without the hardware.  The hidraw node
+ * of the device is printed once the kernel has bound it.
+ *
+ * Besides the short registers it has the pairing table (long register
+ * 0xb5, one mouse in slot 1) and keeps whatever is written to other long
+ * registers.  With --hidpp20 the mouse behind it has no registers but
+ * HID++ 2.0 features instead: root, battery (0x1000) and SmartShift
+ * (0x2110), as on a Unifying receiver.
+ *
+ * Requires write access to /dev/uhid (usually root).
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <linux/uhid.h>
+
+#include "revoco.h"
+
+/* interface 1 of the RR41.01_B0025 receiver */
+static const u8 rdesc[] = {
+	0x05, 0x0c,		/* Usage Page (Consumer) */
+	0x09, 0x01,		/* Usage (Consumer Control) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x03,		/*   Report ID (3) */
+	0x75, 0x10,		/*   Report Size (16) */
+	0x95, 0x02,		/*   Report Count (2) */
+	0x15, 0x01,		/*   Logical Minimum (1) */
+	0x26, 0x8c, 0x02,	/*   Logical Maximum (652) */
+	0x19, 0x01,		/*   Usage Minimum (1) */
+	0x2a, 0x8c, 0x02,	/*   Usage Maximum (652) */
+	0x81, 0x60,		/*   Input (Data,Array,Abs,NoPref,Null) */
+	0xc0,			/* End Collection */
+	0x06, 0x00, 0xff,	/* Usage Page (Vendor 0xff00) */
+	0x09, 0x01,		/* Usage (1) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x10,		/*   Report ID (0x10) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, 0x06,		/*   Report Count (6) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x09, 0x01,		/*   Usage (1) */
+	0x81, 0x00,		/*   Input (Data,Array,Abs) */
+	0x09, 0x01,		/*   Usage (1) */
+	0x91, 0x00,		/*   Output (Data,Array,Abs) */
+	0xc0,			/* End Collection */
+	0x06, 0x00, 0xff,	/* Usage Page (Vendor 0xff00) */
+	0x09, 0x02,		/* Usage (2) */
+	0xa1, 0x01,		/* Collection (Application) */
+	0x85, 0x11,		/*   Report ID (0x11) */
+	0x75, 0x08,		/*   Report Size (8) */
+	0x95, 0x13,		/*   Report Count (19) */
+	0x15, 0x00,		/*   Logical Minimum (0) */
+	0x26, 0xff, 0x00,	/*   Logical Maximum (255) */
+	0x09, 0x02,		/*   Usage (2) */
+	0x81, 0x00,		/*   Input (Data,Array,Abs) */
+	0x09, 0x02,		/*   Usage (2) */
+	0x91, 0x00,		/*   Output (Data,Array,Abs) */
+	0xc0,			/* End Collection */
+};
+
+/* HID++ 1.0 error codes */
+#define ERR_INVALID_SUBID	0x01
+#define ERR_INVALID_ADDRESS	0x02
+#define ERR_UNKNOWN_DEVICE	0x08
+
+/* HID++ 2.0 error codes */
+#define ERR_INVALID_FEATURE	0x06
+#define ERR_INVALID_FUNCTION	0x07
+
+#define PENDING_MAX	64
+#define LONG_REGS	4
+
+struct reply {
+	long long due;
+	u8 len;
+	u8 data[REPORT_MAX];
+};
+
+static int verbose = 0;
+static int fd = -1;
+static short product = MX_REVOLUTION;
+static long long latency = 1000;	/* microseconds */
+static long long noise = 0;		/* input reports per second */
+static int drop = 0;			/* ignore every drop'th request */
+static int hidpp20 = 0;			/* the mouse speaks HID++ 2.0 */
+static volatile sig_atomic_t quit = 0;
+
+static struct reply pending[PENDING_MAX];
+static unsigned pending_head, pending_tail;
+static unsigned requests;
+
+/* the mouse */
+static u8 wheel[3] = { 0x82, 0x00, 0x00 };
+static u8 battery[3] = { 85, 0x00, 0x30 };
+static const unsigned short wpid = 0x251a;	/* wireless product id */
+static const char name[] = "MX Revolution";
+
+/* long registers written so far */
+static struct {
+	u8 reg;
+	u8 val[LONG_VAL];
+} long_regs[LONG_REGS];
+static int nlong;
+
+/* HID++ 2.0 features, by index */
+static const unsigned short features[] = { 0x0000, 0x0001, 0x1000, 0x2110 };
+
+static void fatal(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(stderr, "revoco-sim: ");
+	vfprintf(stderr, fmt, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+	exit(1);
+}
+
+static long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void print_report(const char *tag, const u8 *rep, int n)
+{
+	int i;
+
+	printf("%s:", tag);
+	for (i = 0; i < n; ++i)
+		printf(" %02x", rep[i]);
+	printf("\n");
+}
+
+static void uhid_write(const struct uhid_event *ev)
+{
+	if (write(fd, ev, sizeof(*ev)) != sizeof(*ev))
+		fatal("write /dev/uhid: %s", strerror(errno));
+}
+
+static void send_input(const u8 *rep, int len)
+{
+	struct uhid_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = len;
+	memcpy(ev.u.input2.data, rep, len);
+	if (verbose > 1)
+		print_report("TX", rep, len);
+	uhid_write(&ev);
+}
+
+/* Queue a report to go out after the configured latency. */
+static void queue(u8 id, u8 idx, u8 sub, u8 reg, const u8 *val, int n)
+{
+	struct reply *r;
+
+	if (pending_head - pending_tail == PENDING_MAX) {
+		if (verbose)
+			printf("reply queue full, dropping\n");
+		return;
+	}
+	r = &pending[pending_head++ % PENDING_MAX];
+	memset(r, 0, sizeof(*r));
+	r->due = now() + latency;
+	r->len = id == 0x11 ? REPORT_LONG : REPORT_SHORT;
+	r->data[0] = id;
+	r->data[1] = idx;
+	r->data[2] = sub;
+	r->data[3] = reg;
+	memcpy(r->data + 4, val, n < r->len - 4 ? n : r->len - 4);
+}
+
+static void reply(u8 idx, u8 sub, u8 reg, u8 a1, u8 a2, u8 a3)
+{
+	u8 val[3] = { a1, a2, a3 };
+
+	queue(0x10, idx, sub, reg, val, 3);
+}
+
+static void error_reply(const u8 *req, u8 code)
+{
+	reply(req[1], 0x8f, req[2], req[3], code, 0);
+}
+
+/*
+ * Long register reads: page `page' of the pairing table, or what was
+ * last written to the register.
+ */
+static void long_read(const u8 *req)
+{
+	u8 idx = req[1], reg = req[3], page = req[4], val[LONG_VAL];
+	int i;
+
+	memset(val, 0, sizeof(val));
+	if (reg == 0xb5 && idx == 0xff &&
+	    ((page >= 0x20 && page < 0x26) || (page >= 0x40 && page < 0x46))) {
+		val[0] = page;
+		if (page == 0x20) {	/* slot 1: the mouse */
+			val[1] = 0x40;		/* destination id */
+			val[2] = 0x08;		/* report interval, ms */
+			val[3] = wpid >> 8;
+			val[4] = wpid & 0xff;
+			val[7] = 0x02;		/* a mouse */
+		} else if (page == 0x40) {
+			val[1] = strlen(name);
+			memcpy(val + 2, name, strlen(name));
+		}
+		queue(0x11, idx, 0x83, reg, val, LONG_VAL);
+		return;
+	}
+	for (i = 0; i < nlong; ++i)
+		if (long_regs[i].reg == reg) {
+			queue(0x11, idx, 0x83, reg, long_regs[i].val, LONG_VAL);
+			return;
+		}
+	error_reply(req, ERR_INVALID_ADDRESS);
+}
+
+static void long_write(const u8 *req)
+{
+	int i;
+
+	for (i = 0; i < nlong && long_regs[i].reg != req[3]; ++i)
+		;
+	if (i == LONG_REGS || req[3] == 0xb5) {
+		error_reply(req, ERR_INVALID_ADDRESS);
+		return;
+	}
+	if (i == nlong)
+		++nlong;
+	long_regs[i].reg = req[3];
+	memcpy(long_regs[i].val, req + 4, LONG_VAL);
+	reply(req[1], 0x82, req[3], 0, 0, 0);
+}
+
+/* 0x08: the wheel is in click-to-click mode unless it spins freely */
+static u8 wheel_mode(void)
+{
+	switch (wheel[0] & 0x0f) {
+	case 1:
+	case 3:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/*
+ * A HID++ 2.0 call: feature index, then function and software id, which
+ * the reply echoes.  Errors come back as sub-id 0xff.
+ */
+static void feature_call(const u8 *req)
+{
+	u8 idx = req[1], index = req[2], func = req[3] >> 4, val[LONG_VAL];
+	const u8 *par = req + 4;
+	int i;
+
+	memset(val, 0, sizeof(val));
+	if (index >= sizeof(features) / sizeof(features[0])) {
+		val[0] = req[3];
+		val[1] = ERR_INVALID_FEATURE;
+		queue(0x11, idx, 0xff, index, val, 2);
+		return;
+	}
+	switch (features[index] << 4 | func) {
+	case 0x00000:		/* root: getFeature */
+		for (i = 0; i < sizeof(features) / sizeof(features[0]); ++i)
+			if (features[i] == (par[0] << 8 | par[1]))
+				val[0] = i;
+		break;
+	case 0x00001:		/* root: getProtocolVersion */
+		val[0] = 4;
+		val[1] = 5;
+		val[2] = par[2];
+		break;
+	case 0x00010:		/* feature set: getCount */
+		val[0] = sizeof(features) / sizeof(features[0]) - 1;
+		break;
+	case 0x10000:		/* battery: getBatteryLevelStatus */
+		val[0] = battery[0];
+		val[2] = battery[2] == 0x50 ? 1 : battery[2] == 0x90 ? 3 : 0;
+		break;
+	case 0x21100:		/* SmartShift: getRatchetControlMode */
+		val[0] = wheel_mode() ? 2 : 1;
+		val[1] = (wheel[0] & 0x0f) == 5 ? wheel[1] : 0xff;
+		val[2] = val[1];
+		break;
+	case 0x21101:		/* SmartShift: setRatchetControlMode */
+		if (par[0] == 1)
+			wheel[0] = (wheel[0] & 0x80) | 1;
+		else if (par[0] == 2 && (par[1] == 0xff || par[1] == 0))
+			wheel[0] = (wheel[0] & 0x80) | 2;
+		else if (par[0] == 2) {
+			wheel[0] = (wheel[0] & 0x80) | 5;
+			wheel[1] = par[1];
+		}
+		break;
+	default:
+		val[0] = req[3];
+		val[1] = ERR_INVALID_FUNCTION;
+		queue(0x11, idx, 0xff, index, val, 2);
+		return;
+	}
+	queue(0x11, idx, index, req[3], val, LONG_VAL);
+}
+
+static void request(const u8 *req, int len)
+{
+	u8 idx = req[1], sub = req[2], reg = req[3];
+
+	if (verbose > 1)
+		print_report("RX", req, len);
+	if (drop && ++requests % drop == 0) {
+		if (verbose)
+			printf("dropping request %u\n", requests);
+		return;
+	}
+	if ((req[0] != 0x10 || len < REPORT_SHORT) &&
+	    (req[0] != 0x11 || len < REPORT_LONG)) {
+		if (len >= 4)
+			error_reply(req, ERR_INVALID_ADDRESS);
+		return;
+	}
+	if (idx != 0x01 && idx != 0xff) {
+		error_reply(req, ERR_UNKNOWN_DEVICE);
+		return;
+	}
+	if (hidpp20 && idx == 0x01) {
+		/* no registers, a 1.0 error says so */
+		if (sub & 0x80)
+			error_reply(req, ERR_INVALID_SUBID);
+		else
+			feature_call(req);
+		return;
+	}
+	if (!(sub & 0x80) || sub > 0x83) {
+		error_reply(req, ERR_INVALID_SUBID);
+		return;
+	}
+	if (sub == 0x82) {
+		long_write(req);
+		return;
+	}
+	if (sub == 0x83) {
+		long_read(req);
+		return;
+	}
+
+	if (sub == 0x80 && idx == 0x01 && reg == 0x56) {
+		memcpy(wheel, req + 4, 3);
+		reply(idx, sub, reg, 0, 0, 0);
+	} else if (sub == 0x80 && idx == 0xff && reg == 0xb2)
+		reply(idx, sub, reg, 0, 0, 0);
+	else if (sub == 0x81 && idx == 0x01 && reg == 0x56)
+		reply(idx, sub, reg, wheel[0], wheel[1], wheel[2]);
+	else if (sub == 0x81 && idx == 0x01 && reg == 0x08)
+		reply(idx, sub, reg, 0, 0, wheel_mode());
+	else if (sub == 0x81 && idx == 0x01 && reg == 0x0d)
+		reply(idx, sub, reg, battery[0], battery[1], battery[2]);
+	else
+		error_reply(req, ERR_INVALID_ADDRESS);
+}
+
+static void handle_event(void)
+{
+	struct uhid_event ev, ans;
+	ssize_t res;
+
+	res = read(fd, &ev, sizeof(ev));
+	if (res < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		fatal("read /dev/uhid: %s", strerror(errno));
+	}
+
+	switch (ev.type) {
+	case UHID_START:
+		if (verbose)
+			printf("started\n");
+		break;
+	case UHID_STOP:
+		if (verbose)
+			printf("stopped\n");
+		break;
+	case UHID_OPEN:
+	case UHID_CLOSE:
+		if (verbose > 1)
+			printf("%s\n", ev.type == UHID_OPEN ? "opened" : "closed");
+		break;
+	case UHID_OUTPUT:
+		request(ev.u.output.data, ev.u.output.size);
+		break;
+	case UHID_GET_REPORT:
+		memset(&ans, 0, sizeof(ans));
+		ans.type = UHID_GET_REPORT_REPLY;
+		ans.u.get_report_reply.id = ev.u.get_report.id;
+		ans.u.get_report_reply.err = EIO;
+		uhid_write(&ans);
+		break;
+	case UHID_SET_REPORT:
+		/* hidraw writes end up here on some kernels */
+		request(ev.u.set_report.data, ev.u.set_report.size);
+		memset(&ans, 0, sizeof(ans));
+		ans.type = UHID_SET_REPORT_REPLY;
+		ans.u.set_report_reply.id = ev.u.set_report.id;
+		uhid_write(&ans);
+		break;
+	}
+}
+
+/*
+ * Print the hidraw node the kernel made for us, recognised by the
+ * unique id set at creation.
+ */
+static int find_node(const char *uniq)
+{
+	char path[512], line[256];
+	struct dirent *de;
+	int found = 0;
+	DIR *dir;
+
+	dir = opendir("/sys/class/hidraw");
+	if (!dir)
+		return 0;
+	while (!found && (de = readdir(dir))) {
+		FILE *f;
+
+		if (strncmp(de->d_name, "hidraw", 6))
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent",
+			 de->d_name);
+		if (!(f = fopen(path, "r")))
+			continue;
+		while (fgets(line, sizeof(line), f))
+			if (strncmp(line, "HID_UNIQ=", 9) == 0 &&
+			    strncmp(line + 9, uniq, strlen(uniq)) == 0 &&
+			    line[9 + strlen(uniq)] == '\n') {
+				printf("/dev/%s\n", de->d_name);
+				fflush(stdout);
+				found = 1;
+			}
+		fclose(f);
+	}
+	closedir(dir);
+	return found;
+}
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static void usage(void)
+{
+	printf("revoco-sim - virtual MX-Revolution receiver\n\n");
+	printf("Usage: revoco-sim [options]\n\n");
+	printf("Options:\n");
+	printf("  -l, --latency=US     answer after US microseconds (default 1000)\n");
+	printf("  -n, --noise=RATE     send RATE input reports per second\n");
+	printf("  -d, --drop=N         ignore every Nth request\n");
+	printf("  -2, --hidpp20        the mouse speaks HID++ 2.0 (implies -p %04hx)\n",
+	       MX_REVOLUTION4);
+	printf("  -p, --product=ID     USB product id (default %04hx)\n", MX_REVOLUTION);
+	printf("  -v, --verbose        print events, twice for every report\n");
+	printf("\n");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+	    {"help",	no_argument,		0, 'h'},
+	    {"latency",	required_argument,	0, 'l'},
+	    {"noise",	required_argument,	0, 'n'},
+	    {"drop",	required_argument,	0, 'd'},
+	    {"hidpp20",	no_argument,		0, '2'},
+	    {"product",	required_argument,	0, 'p'},
+	    {"verbose",	no_argument,		0, 'v'},
+	    {0,		0,			0, 0}
+	};
+	struct uhid_event ev;
+	struct sigaction sa;
+	long long next_noise = 0, t;
+	char uniq[64];
+	int opt, shown = 0, product_set = 0;
+
+	while ((opt = getopt_long(argc, argv, "2d:hl:n:p:v",
+				  long_options, NULL)) >= 0) {
+		switch (opt) {
+		case '2':
+			hidpp20 = 1;
+			break;
+		case 'd':
+			drop = atoi(optarg);
+			break;
+		case 'l':
+			latency = atoll(optarg);
+			break;
+		case 'n':
+			noise = atoll(optarg);
+			break;
+		case 'p':
+			product = strtol(optarg, NULL, 16);
+			product_set = 1;
+			break;
+		case 'v':
+			++verbose;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (latency < 0 || noise < 0 || noise > 1000000 || drop < 0)
+		fatal("bad argument");
+	if (hidpp20 && !product_set)
+		product = MX_REVOLUTION4;
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		fatal("/dev/uhid: %s", strerror(errno));
+
+	snprintf(uniq, sizeof(uniq), "revoco-sim-%d", (int)getpid());
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "Logitech USB Receiver");
+	snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+		 "%s", uniq);
+	ev.u.create2.rd_size = sizeof(rdesc);
+	memcpy(ev.u.create2.rd_data, rdesc, sizeof(rdesc));
+	ev.u.create2.bus = 0x03;	/* BUS_USB */
+	ev.u.create2.vendor = (unsigned short)LOGITECH;
+	ev.u.create2.product = (unsigned short)product;
+	ev.u.create2.version = 0x4101;
+	uhid_write(&ev);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!quit) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		long long wait = shown ? -1 : 100000;
+
+		t = now();
+		if (pending_head != pending_tail) {
+			long long w = pending[pending_tail % PENDING_MAX].due - t;
+
+			if (wait < 0 || w < wait)
+				wait = w > 0 ? w : 0;
+		}
+		if (noise) {
+			if (!next_noise)
+				next_noise = t;
+			if (wait < 0 || next_noise - t < wait)
+				wait = next_noise > t ? next_noise - t : 0;
+		}
+
+		if (poll(&pfd, 1, wait < 0 ? -1 : (wait + 999) / 1000) < 0 &&
+		    errno != EINTR)
+			fatal("poll: %s", strerror(errno));
+		if (pfd.revents & POLLIN)
+			handle_event();
+
+		t = now();
+		while (pending_head != pending_tail &&
+		       pending[pending_tail % PENDING_MAX].due <= t) {
+			struct reply *r = &pending[pending_tail++ % PENDING_MAX];
+
+			send_input(r->data, r->len);
+		}
+		if (noise && next_noise <= t) {
+			static const u8 key[5] = { 0x03, 0x00, 0x00, 0x00, 0x00 };
+
+			send_input(key, sizeof(key));
+			next_noise += 1000000 / noise;
+		}
+		if (!shown)
+			shown = find_node(uniq);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	uhid_write(&ev);
+	close(fd);
+	return 0;
+}
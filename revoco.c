@@ -29,6 +29,11 @@
  *   SEND: 0x10 RECEIVER COMMAND REGISTER ARG1 ARG2 ARG3
  *   RECV: 0x10 RECIEVER COMMAND REGISTER ANS1 ANS2 ANS3
  *   ERR:  0x10 RECIEVER 0x8F    COMMAND REGISTER CODE ??
+ *
+ *   LONG_MESSAGE (0x11) Commands (Length is 20 BYTES)
+ *   SEND: 0x11 RECEIVER 0x82 REGISTER ARG1 .. ARG16
+ *   RECV: 0x11 RECEIVER 0x83 REGISTER ANS1 .. ANS16
+ *	(the 0x83 request and the 0x82 answer are short messages)
  *   RECEIVERS
  *	0x01 MOUSE
  *	0x02 KEYBOARD
@@ -36,6 +41,8 @@
  *   COMMANDS
  *	0x80 SET REGISTER
  *      0x81 GET REGISTER
+ *	0x82 SET LONG REGISTER
+ *	0x83 GET LONG REGISTER
  *   REGISTERS
  *	0x08 WHEEL MODE
  *		ANS3  0 = free, 1 = click
@@ -72,6 +79,8 @@
  * battery/mode request work for MX-5500 combo.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -80,30 +89,43 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
-#include <sys/ioctl.h>
-#include <linux/types.h>
-#include <linux/input.h>
-#include <linux/hidraw.h>
-
-typedef unsigned char u8;
-typedef signed short s16;
-typedef signed int s32;
-typedef unsigned int u32;
+#include <setjmp.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#include "revoco.h"
 
 #define streq(a,b)	(strcmp((a), (b)) == 0)
 #define strneq(a,b,c)	(strncmp((a), (b), (c)) == 0)
 
-#define LOGITECH	(short)0x046d
-#define MX_REVOLUTION	(short)0xc51a	// version RR41.01_B0025
-#define MX_REVOLUTION2	(short)0xc525	// version RQR02.00_B0020
-#define MX_REVOLUTION3	(short)0xc526	// don't know which version this is
-#define MX_REVOLUTION4	(short)0xc52b	// Unifying Receiver (added 2015-05-30)
-#define MX_REVOLUTION5	(short)0xb007	// ??? R0019 (added 2015-05-30)
-#define MX_5500		(short)0xc71c	// keyboard/mouse combo - experimental
+static int debug = 0;
+
+/* per-command deadline (--timeout), in milliseconds */
+static int timeout = 2000;
+static int timeout_set = 0;
 
-static u8 first_byte;
+/* write settings even if the receiver already has them (--force) */
+static int force = 0;
 
-static int debug = 0;
+/* print the statistics when done (--stats) */
+static int stats = 0;
+
+/* paired device to talk to (--slot), 0 for the receiver's default */
+#define SLOT_ALL	-1
+static int slot = 0;
+
+/*
+ * While the daemon serves a request, fatal() must not take the whole
+ * daemon down; it jumps back to the request loop instead.
+ */
+static jmp_buf *fatal_jmp;
 
 static void fatal(const char *fmt, ...)
 {
@@ -115,313 +137,2073 @@ static void fatal(const char *fmt, ...)
 	fprintf(stderr, "\n");
 	va_end(args);
 
+	if (fatal_jmp)
+		longjmp(*fatal_jmp, 1);
 	exit(1);
 }
 
-static int check_dev(int fd)
+/*
+ * The receivers to drive, from --device or --all.
+ */
+static char **devs;
+static int ndevs;
+
+static int add_dev(const char *path, void *arg)
 {
-	struct hidraw_devinfo dinfo;
+	devs = realloc(devs, (ndevs + 1) * sizeof(*devs));
+	if (!devs || !(devs[ndevs++] = strdup(path)))
+		fatal("out of memory");
+	return 0;
+}
 
-	if (ioctl(fd, HIDIOCGRAWINFO, &dinfo) == 0)
-	{
-		if (debug > 1)
-			printf("Checking %04hx:%04hx\n",
-			       dinfo.vendor,
-			       dinfo.product);
-
-		if (dinfo.vendor == LOGITECH)
-		{
-			switch (dinfo.product) {
-			case MX_REVOLUTION:
-			case MX_REVOLUTION2:
-			case MX_REVOLUTION3:
-			case MX_REVOLUTION4:
-			case MX_REVOLUTION5:
-				first_byte = 1;
-				break;
+static void all_devs(void)
+{
+	struct mx_dev dev;
+	char buf[128];
+	int i;
 
-			case MX_5500:
-				first_byte = 2;
-				break;
-			}
+	if (mx_scan(debug, add_dev, NULL) == 0)
+		return;
 
-			if (first_byte != 0) {
-				if (debug)
-					printf("Found %04hx:%04hx first_byte:%d\n",
-					       dinfo.vendor,
-					       dinfo.product,
-					       first_byte);
-				return fd;
-			}
+	mx_init(&dev);
+	for (i = 0; i < 16; ++i) {
+		sprintf(buf, "/dev/hidraw%d", i);
+		if (mx_open(&dev, buf) == 0) {
+			add_dev(buf, NULL);
+			mx_close(&dev);
 		}
 	}
-	return -1;
 }
 
-static void init_dev(int fd)
+static void bad_answer(const u8 *res)
 {
-	if (fcntl(fd, F_SETFL, O_RDWR) == -1)
-		printf("fcntl(O_NONBLOCK): %s\n", strerror(errno));
+	int i;
+
+	printf("bad answer:");
+	for (i = 0; i < 6; ++i)
+		printf("%02X ", res[i]);
+	printf("\n");
 }
 
-static void close_dev(int fd)
+/* Tell why a query failed. */
+static void query_failed(const struct query *q)
 {
-	close(fd);
+	if (q->state == Q_TIMEOUT)
+		fprintf(stderr, "revoco: no answer for register %02x "
+			"within %dms\n", q->reg, timeout);
+	else if (q->res[1] == 0x8f)
+		bad_answer(q->res);
 }
 
-static int send_report(int fd, u8 id, const u8 *buf, int n)
+/*
+ * Parse the verbs argv[1..argc-1] before anything is sent.
+ */
+static void compile(struct mx_plan *plan, int argc, char **argv)
 {
-	int i, res;
-	u8 *send_buf = (u8*) malloc(n+1);
-	send_buf[0] = id;
+	if (mx_plan_compile(plan, argc, argv) < 0)
+		fatal("%s", mx_strerror());
+}
 
-	for(i = 1; i < n+1; i++) {
-		send_buf[i] = buf[i-1];
+/* Register 0x0d, or its notification, without the report id. */
+static void print_battery(const u8 *buf)
+{
+	char str[32] = { 0 }, *st;
+
+	switch (buf[5])
+	{
+		case 0x30:	st = "running on battery";	break;
+		case 0x50:	st = "charging";		break;
+		case 0x90:	st = "fully charged";		break;
+		case 0xd0:	st = "battery bad";		break;
+		default:	sprintf(st = str, "status %02x", buf[5]);
 	}
+	printf("battery level %d%%, %s\n", buf[3], st);
+}
 
-	if (debug > 2) {
-		printf("TX:");
-		for (i = 0; i < n+1; ++i)
-			printf(" %02x", send_buf[i]);
-		printf("\n");
+/*
+ * The battery in a notification, [id idx reg r0 r1 r2], of register 0x0d
+ * (percent) or 0x07 (level 1-7 and charging status), as a percentage and
+ * a register 0x0d state byte.  Returns 0 if it is about something else,
+ * which includes other devices and HID++ 2.0 events: there the third
+ * byte is a feature index, not a register.
+ */
+static int battery_parse(const struct mx_dev *dev, const u8 *rep,
+			 u8 *level, u8 *state)
+{
+	if (rep[1] != dev->idx ||
+	    (rep[1] < PROTO_MAX && dev->proto[rep[1]] == 2))
+		return 0;
+	switch (rep[2]) {
+	case 0x0d:
+		*level = rep[3];
+		*state = rep[5];
+		return 1;
+	case 0x07:
+		*level = (rep[3] & 7) * 100 / 7;
+		*state = rep[4] == 0x21 || rep[4] == 0x22 ? 0x50 :
+			 rep[4] == 0x23 ? 0x90 : 0x30;
+		return 1;
 	}
+	return 0;
+}
 
-	res = write(fd, send_buf, n+1);
+/* The receiver's pairing table, for "list". */
+static int list_pairings(struct mx_dev *dev)
+{
+	static const char *kinds[16] = {
+		"unknown", "keyboard", "mouse", "numpad", "presenter",
+		[8] = "remote", "trackball", "touchpad"
+	};
+	struct mx_pairing p[SLOT_MAX];
+	int i;
 
-	if (res < 0) {
-		printf("Error: %d\n", errno);
-		perror("send_report");
+	if (mx_pairings(dev, p) < 0) {
+		fprintf(stderr, "revoco: no pairing table: %s\n",
+			strerror(errno));
+		return 1;
 	}
-	return res;
+	for (i = 0; i < SLOT_MAX; ++i) {
+		printf("slot %d:", p[i].slot);
+		if (!p[i].kind && !p[i].wpid) {
+			printf(" free\n");
+			continue;
+		}
+		printf(" %s %04x", kinds[p[i].kind] ? kinds[p[i].kind] : "device",
+		       p[i].wpid);
+		if (p[i].name[0])
+			printf(" \"%s\"", p[i].name);
+		if (p[i].slot == dev->idx)
+			printf(" (default)");
+		printf("\n");
+	}
+	return 0;
 }
 
-static void query_report(int fd, u8 id, u8 *buf, int n)
+/* Print the outcome of a step; returns 1 if it failed. */
+static int report(struct mx_dev *dev, const struct mx_step *st)
 {
-	int res;
-	res = read(fd, buf, n+1);
-	if (debug > 1) {
-		int i;
-		printf("RX:");
-		for (i = 0; i < n+1; ++i)
-			printf(" %02x", buf[i]);
+	const u8 *buf = st->q.res;
+	int j;
+
+	if (st->q.state != Q_DONE && st->verb != V_DUMP) {
+		if (st->verb == V_RECV)
+			fprintf(stderr, "revoco: no report within %dms\n",
+				timeout);
+		else if (st->verb != V_RAW)
+			query_failed(&st->q);
+		return 1;
+	}
+
+	switch (st->verb) {
+	case V_RECONNECT:
+		printf("Reconnection initiated\n");
+		printf(" - Turn off the mouse\n");
+		printf(" - Press and hold the left mouse button\n");
+		printf(" - Turn on the mouse\n");
+		printf(" - Press the right button 5 times\n");
+		printf(" - Release the left mouse button\n");
+		break;
+
+	case V_MODE:
+		if (buf[5] & 1)
+			printf("click-by-click\n");
+		else
+			printf("free spinning\n");
+		break;
+
+	case V_BATTERY:
+		print_battery(buf);
+		break;
+
+	case V_DUMP:
+		printf("register %02x:", st->q.reg);
+		if (st->q.state == Q_DONE) {
+			for (j = 3; j < st->q.len; ++j)
+				printf(" %02x", buf[j]);
+			printf("\n");
+		} else if (st->q.state == Q_TIMEOUT)
+			printf(" no answer\n");
+		else
+			printf(" error %02x\n", buf[4]);
+		break;
+
+	case V_RECV:
+		printf("report %02x:", st->arg);
+		for (j = 0; j < st->len; ++j)
+			printf(" %02x", st->data[j]);
 		printf("\n");
+		break;
+
+	case V_STATS:
+		mx_print_stats(dev);
+		break;
+
+	case V_LIST:
+		return list_pairings(dev);
 	}
-	buf = buf+1;
-	if (res < 0) {
-		perror("read");
+	return 0;
+}
+
+/*
+ * Run a compiled command line: each batch of register steps goes out
+ * back to back, and its results are printed once all of them are in.
+ */
+static int run_plan(struct mx_dev *dev, struct mx_plan *plan)
+{
+	int i, j, next, status = 0;
+
+	for (i = 0; i < plan->n; i = next) {
+		next = mx_plan_run(dev, plan, i);
+		for (j = i; j < next; ++j)
+			status |= report(dev, &plan->step[j]);
+		fflush(stdout);
+	}
+	return status;
+}
+
+/* Run the command line on the device(s) --slot asks for. */
+static int configure(struct mx_dev *dev, struct mx_plan *plan)
+{
+	struct mx_pairing p[SLOT_MAX];
+	u8 idx = dev->idx;
+	int i, status = 0;
+
+	if (slot == 0)
+		return run_plan(dev, plan);
+
+	if (slot != SLOT_ALL) {
+		mx_select(dev, slot);
+		status = run_plan(dev, plan);
+		mx_select(dev, idx);
+		return status;
+	}
+
+	if (mx_pairings(dev, p) < 0) {
+		fprintf(stderr, "revoco: no pairing table: %s\n",
+			strerror(errno));
+		return 1;
 	}
+	for (i = 0; i < SLOT_MAX; ++i) {
+		if (!p[i].kind && !p[i].wpid)
+			continue;
+		printf("slot %d:\n", p[i].slot);
+		mx_select(dev, p[i].slot);
+		status |= run_plan(dev, plan);
+	}
+	mx_select(dev, idx);
+	return status;
+}
+
+/*
+ * Daemon mode.
+ *
+ * The daemon opens the receiver once and serves the usual command line
+ * verbs over a unix socket.  A request is the list of verbs, each one
+ * terminated by a NUL, with an empty string marking the end.  The reply
+ * is whatever configure() printed, followed by a NUL and the exit status.
+ */
+#define REQ_MAX		4096
+
+static volatile sig_atomic_t daemon_quit;
+
+static void daemon_signal(int sig)
+{
+	daemon_quit = 1;
+}
+
+static const char *sock_path(const char *path)
+{
+	static char buf[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	const char *dir;
+
+	if (path)
+		return path;
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (dir && *dir)
+		snprintf(buf, sizeof(buf), "%s/revoco.sock", dir);
+	else
+		snprintf(buf, sizeof(buf), "/tmp/revoco-%u.sock", (unsigned)getuid());
+	return buf;
+}
+
+static int sock_addr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path))
+		return -1;
+	strcpy(sun->sun_path, path);
+	return 0;
 }
 
-static int mx_cmd(int fd, u8 b1, u8 b2, u8 b3)
+static int sock_connect(const char *path)
 {
-	u8 buf[6] = { first_byte, 0x80, 0x56, b1, b2, b3 };
+	struct sockaddr_un sun;
+	int fd;
+
+	if (sock_addr(&sun, path) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
 
-	return send_report(fd, 0x10, buf, 6);
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
 }
 
-static int mx_query(int fd, u8 b1, u8 *res)
+/*
+ * Whether the daemon at the other end of `fd' is ours or root's.  Anyone
+ * can put a socket at /tmp/revoco-UID.sock first.
+ */
+static int sock_trusted(int fd)
 {
-	u8 buf[6] = { first_byte, 0x81, b1, 0, 0, 0 };
-	int i, rc;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
 
-	rc = send_report(fd, 0x10, buf, 6);
-	if (rc < 0)
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
 		return 0;
-	query_report(fd, 0x10, res, 6);
-
-	for (int i = 0; i < 6; i++)
-		res[i] = res[i+1];
-
-	if ((
-		(res[0] != 0x02 && res[0] != 0x01 && res[0] != 0x00) ||
-		res[1]  != 0x81 ||
-		(res[2] != 0xb1 && res[2] != 0x08)
-	) && (
-		(res[0] != 0x02 && res[0] != 0x01 && res[0] != 0x00) ||
-		res[1]  != 0x81 ||
-		(res[2] != 0x0d && res[2] != 0x08)
-	))
-	{
-		printf("bad answer:");
-		for (i = 0; i < 6; ++i)
-		{
-			printf("%02X ", res[i]);
+	return cred.uid == getuid() || cred.uid == 0;
+}
+
+static int write_all(int fd, const void *buf, size_t n)
+{
+	const char *p = buf;
+	ssize_t res;
+
+	while (n) {
+		res = write(fd, p, n);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
 		}
-		printf("\n");
-		return 0;
+		p += res, n -= res;
+	}
+	return 0;
+}
+
+/*
+ * Forward the verbs to a running daemon, preceded by "--force" and
+ * "--slot=N" and followed by "stats" if asked for.  Returns -1 if there
+ * is none, so the caller can fall back to talking to the device itself.
+ */
+static int client(const char *path, int argc, char **argv)
+{
+	char buf[REQ_MAX];
+	int fd, i, n = 0, len;
+	ssize_t res;
+
+	if (force) {
+		memcpy(buf, "--force", 8);
+		n = 8;
+	}
+	if (slot)
+		n += sprintf(buf + n, "--slot=%d", slot) + 1;
+	if (timeout_set)
+		n += sprintf(buf + n, "--timeout=%d", timeout) + 1;
+	if (debug)
+		n += sprintf(buf + n, "--verbose=%d", debug) + 1;
+	for (i = 0; i < argc; ++i) {
+		len = strlen(argv[i]) + 1;
+		if (n + len + sizeof("stats") + 1 > sizeof(buf))
+			fatal("command line too long for the daemon");
+		memcpy(buf + n, argv[i], len);
+		n += len;
 	}
+	if (stats) {
+		memcpy(buf + n, "stats", 6);
+		n += 6;
+	}
+	buf[n++] = '\0';
+
+	fd = sock_connect(sock_path(path));
+	if (fd < 0)
+		return -1;
+	if (!sock_trusted(fd)) {
+		fprintf(stderr, "revoco: ignoring %s, not our daemon\n",
+			sock_path(path));
+		close(fd);
+		return -1;
+	}
+
+	if (debug > 1)
+		printf("Using daemon at %s\n", sock_path(path));
+
+	if (write_all(fd, buf, n) < 0)
+		fatal("daemon: %s", strerror(errno));
+
+	/* output, then NUL and the exit status */
+	n = 0;
+	while ((res = read(fd, buf, sizeof(buf))) != 0) {
+		char *end;
+
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("daemon: %s", strerror(errno));
+		}
+		if (n) {
+			close(fd);
+			return (u8)buf[0];
+		}
+		end = memchr(buf, '\0', res);
+		fwrite(buf, 1, end ? end - buf : res, stdout);
+		if (end) {
+			if (end + 1 < buf + res) {
+				close(fd);
+				return (u8)end[1];
+			}
+			n = 1;
+		}
+	}
+	close(fd);
+	fatal("daemon closed the connection");
 	return 1;
 }
 
-static char * onearg(char *str, char prefix, u8 *arg, int def, int min, int max)
+/*
+ * Battery watch in the daemon.  Mice that can report battery changes
+ * themselves are asked to; the others are polled, each at an interval
+ * adapted to how fast its battery ran down so far and to the state it
+ * is in.  A single timerfd wakes the daemon for the earliest read due,
+ * and every read that is nearly due is done in the same wakeup.
+ */
+#define BAT_MIN		60		/* seconds between reads */
+#define BAT_MAX		3600
+#define BAT_START	600		/* until the rate is known */
+#define BAT_CHARGING	300
+#define BAT_LOW		20		/* percent, read twice as often */
+
+#define NOTIFY_BATTERY	0x10	/* reporting flags (register 0x00), byte 0 */
+
+static void trouble_shooting(struct mx_dev *dev);
+
+struct battery {
+	int notify;		/* the mouse reports changes itself */
+	int none;		/* nor can it be read */
+	u8 flags[3];		/* its reporting flags before that */
+	int known;
+	u8 level, state;	/* last reading */
+	long long changed;	/* when the level last dropped */
+	long long per_pct;	/* microseconds per percent, 0 if unknown */
+	long long interval, next;
+	struct query q;
+};
+
+/*
+ * A receiver the daemon serves.  The device comes first, so that its
+ * notification handler can get back to the unit.
+ */
+struct unit {
+	struct mx_dev dev;
+	struct battery bat;
+	int mode;		/* register 0x08 byte 2, -1 if unknown */
+};
+
+static struct unit *units;
+static int nunits;
+static struct mx_status *status_seg;
+
+/* Publish what is known about a unit in the status segment. */
+static void unit_publish(struct unit *u)
+{
+	struct mx_status_dev d;
+
+	memset(&d, 0, sizeof(d));
+	snprintf(d.path, sizeof(d.path), "%s", u->dev.path);
+	if (u->bat.known) {
+		d.battery = u->bat.level;
+		d.state = u->bat.state;
+	}
+	d.mode = u->mode & 1;
+	d.mode_known = u->mode >= 0;
+	mx_status_publish(status_seg, u - units, &d);
+}
+
+/*
+ * Read the battery or the wheel mode through a plan, so that a HID++ 2.0
+ * mouse is asked through its features; `q' gets the outcome in the form
+ * of register 0x0d or 0x08.
+ */
+static void dev_read(struct mx_dev *dev, char *verb, struct query *q)
 {
-	char *end;
-	long n;
+	char *argv[] = { "revoco", verb, NULL };
+	struct mx_plan plan;
+
+	if (mx_plan_compile(&plan, 2, argv) < 0)
+		fatal("%s", mx_strerror());
+	mx_plan_run(dev, &plan, 0);
+	*q = plan.step[0].q;
+	mx_plan_free(&plan);
+}
 
-	*arg = def;
+/* Whether a failed read means the mouse has no such thing at all. */
+static int unit_lacks(const struct query *q)
+{
+	return q->state == Q_ERROR && q->res[1] == 0x8f &&
+	       (q->res[4] == 0x01 || q->res[4] == 0x02);
+}
 
-	if (*str == '\0')
-		return str;
+static void mode_read(struct unit *u)
+{
+	struct query q;
 
-	if (*str != prefix)
-		fatal("bad argument `%s': `%c' expected", str, prefix);
+	dev_read(&u->dev, "mode", &q);
+	u->mode = q.state == Q_DONE ? q.res[5] : -1;
+	unit_publish(u);
+}
 
-	n = strtol(++str, &end, 0);
-	if (str != end)
-	{
-		*arg = n;
-		if (n < min || n > max)
-			fatal("argument `%.*s' out of range (%d-%d)", end - str, str, min, max);
+static long long bat_interval(const struct battery *b)
+{
+	long long t;
+
+	switch (b->state) {
+	case 0x50:
+		return BAT_CHARGING;
+	case 0x90:
+	case 0xd0:
+		return BAT_MAX;
 	}
-	return end;
+	if (!b->per_pct)
+		return b->level <= BAT_LOW ? BAT_MIN : BAT_START;
+
+	/* about once per percent lost, twice when running low */
+	t = b->per_pct / 1000000;
+	if (b->level <= BAT_LOW)
+		t /= 2;
+	return t < BAT_MIN ? BAT_MIN : t > BAT_MAX ? BAT_MAX : t;
 }
 
-static void twoargs(char *str, u8 *arg1, u8 *arg2, int def, int min, int max)
+static void bat_sample(struct unit *u, u8 level, u8 state)
 {
-	char *p = str;
+	struct battery *b = &u->bat;
+	long long now = mx_now();
 
-	p = onearg(p, '=', arg1, def, min, max);
-	p = onearg(p, ',', arg2, *arg1, min, max);
-	if (*p)
-		fatal("malformed argument `%s'", str);
+	if (!b->known || state != 0x30 || level > b->level)
+		b->changed = now;
+	else if (level < b->level) {
+		long long per = (now - b->changed) / (b->level - level);
+
+		b->per_pct = b->per_pct ? (3 * b->per_pct + per) / 4 : per;
+		b->changed = now;
+	}
+	if (debug && (!b->known || level != b->level || state != b->state))
+		printf("%s: battery %d%%, state %02x\n", u->dev.path,
+		       level, state);
+	b->known = 1;
+	b->level = level;
+	b->state = state;
+	b->interval = bat_interval(b);
+	b->next = now + b->interval * 1000000LL;
+	unit_publish(u);
 }
 
-static int nargs(char *str, u8 *buf, int n, int def, int min, int max)
+static void daemon_notify(struct mx_dev *dev, const u8 *rep, int len)
 {
-	char *p = str;
-	int i = 0, del = '=';
+	u8 level, state;
 
-	while (n--)
-	{
-		if (*p)
-			i++;
-		p = onearg(p, del, buf++, def, min, max);
-		del = ',';
+	++dev->rx_notify;
+	if (battery_parse(dev, rep, &level, &state))
+		bat_sample((struct unit *)dev, level, state);
+	else if (debug > 1)
+		printf("notification %02x from device %d\n", rep[2], rep[1]);
+}
+
+static void bat_init(struct unit *u)
+{
+	struct mx_dev *dev = &u->dev;
+	struct battery *b = &u->bat;
+	u8 res[6];
+
+	memset(b, 0, sizeof(*b));
+	dev->notify_handler = daemon_notify;
+	if (mx_query(dev, 0x00, res) == 1) {
+		struct query q = { dev->idx, 0x80, 0x00,
+				   { res[3] | NOTIFY_BATTERY, res[4], res[5] } };
+
+		memcpy(b->flags, res + 3, 3);
+		b->notify = mx_query_many(dev, &q, 1) == 1;
+	}
+	if (debug)
+		printf("%s: battery %s\n", dev->path,
+		       b->notify ? "notifications enabled" : "polled");
+	dev_read(&u->dev, "battery", &b->q);
+	if (b->q.state == Q_DONE)
+		bat_sample(u, b->q.res[3], b->q.res[5]);
+	else
+		b->next = mx_now() + BAT_START * 1000000LL;
+	b->none = !b->notify && unit_lacks(&b->q);
+	if (b->none && debug)
+		printf("%s: no battery to read\n", dev->path);
+}
+
+static void bat_done(struct unit *u)
+{
+	struct mx_dev *dev = &u->dev;
+	struct battery *b = &u->bat;
+	struct query q = { dev->idx, 0x80, 0x00,
+			   { b->flags[0], b->flags[1], b->flags[2] } };
+
+	if (b->notify && dev->fd >= 0)
+		mx_query_many(dev, &q, 1);
+}
+
+/*
+ * Read all batteries that are due within the last quarter of their wait,
+ * those behind registers in one go; HID++ 2.0 mice are asked one by one.
+ */
+static void bat_poll(void)
+{
+	long long now = mx_now();
+	int i, n = 0;
+
+	for (i = 0; i < nunits; ++i) {
+		struct unit *u = &units[i];
+		struct battery *b = &u->bat;
+
+		b->q.sub = 0;
+		if (b->notify || b->none || u->dev.fd < 0 ||
+		    b->next - b->interval * 250000LL > now)
+			continue;
+		if (mx_features(&u->dev, u->dev.idx, NULL, 0) == 2) {
+			dev_read(&u->dev, "battery", &b->q);
+			++n;
+			continue;
+		}
+		memset(&b->q, 0, sizeof(b->q));
+		b->q.idx = u->dev.idx;
+		b->q.sub = 0x81;
+		b->q.reg = 0x0d;
+		mx_submit(&u->dev, &b->q);
+		++n;
+	}
+	if (debug > 1 && n)
+		printf("Reading %d batteries\n", n);
+
+	for (i = 0; i < nunits; ++i) {
+		struct unit *u = &units[i];
+		struct battery *b = &u->bat;
+
+		if (!b->q.sub)
+			continue;
+		mx_flush(&u->dev);
+		if (b->q.state == Q_DONE)
+			bat_sample(u, b->q.res[3], b->q.res[5]);
+		else if (unit_lacks(&b->q)) {
+			if (debug)
+				printf("%s: no battery to read\n", u->dev.path);
+			b->none = 1;
+		} else
+			b->next = now + BAT_MIN * 1000000LL;
+	}
+}
+
+static void bat_arm(int tfd)
+{
+	struct itimerspec its;
+	long long next = -1;
+	int i;
+
+	for (i = 0; i < nunits; ++i) {
+		struct battery *b = &units[i].bat;
+
+		if (!b->notify && !b->none && units[i].dev.fd >= 0 &&
+		    (next < 0 || b->next < next))
+			next = b->next;
+	}
+	memset(&its, 0, sizeof(its));
+	if (next >= 0) {
+		if (next < 1)
+			next = 1;
+		its.it_value.tv_sec = next / 1000000;
+		its.it_value.tv_nsec = next % 1000000 * 1000;
+	}
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timerfd_settime");
+}
+
+/*
+ * Take what a request read along into the status segment; if it may
+ * have changed the wheel mode without reading it, read it.  A wheel
+ * write that mx_plan_run() skipped, the mouse having that setting
+ * already, was never sent and changed nothing.
+ */
+static void unit_update(struct unit *u, const struct mx_plan *plan)
+{
+	int i, stale = 0;
+
+	for (i = 0; i < plan->n; ++i) {
+		const struct mx_step *st = &plan->step[i];
+
+		/*
+		 * Readings of other paired devices (--slot) are not this
+		 * unit's; with --slot=all the steps hold those of the last
+		 * slot, and the unit's own wheel may have been written.
+		 */
+		if (st->verb != V_RAW && st->q.idx != u->dev.idx) {
+			if (st->verb == V_WHEEL && slot == SLOT_ALL)
+				stale = 1;
+			continue;
+		}
+		switch (st->verb) {
+		case V_MODE:
+			if (st->q.state == Q_DONE) {
+				u->mode = st->q.res[5];
+				stale = 0;
+				unit_publish(u);
+			}
+			break;
+		case V_BATTERY:
+			if (st->q.state == Q_DONE)
+				bat_sample(u, st->q.res[3], st->q.res[5]);
+			break;
+		case V_WHEEL:
+			if (st->q.sent || st->call.sent)
+				stale = 1;
+			break;
+		case V_RAW:
+			stale = 1;
+			break;
+		}
+	}
+	if (stale)
+		mode_read(u);
+}
+
+/*
+ * Get a unit back whose receiver went away, the way daemon_open() found
+ * it.  Returns 0 if it is there again.
+ */
+static int unit_reopen(struct unit *u)
+{
+	struct mx_dev *dev = &u->dev;
+	char path[sizeof(dev->path)];
+	int res;
+
+	snprintf(path, sizeof(path), "%s", dev->path);
+	if (ndevs > 1)
+		res = mx_open(dev, path);
+	else
+		res = (ndevs && mx_open(dev, devs[0]) == 0) ||
+		      mx_find(dev) == 0 ? 0 : -1;
+	if (res < 0) {
+		snprintf(dev->path, sizeof(dev->path), "%s", path);
+		return -1;
+	}
+	if (debug)
+		printf("%s is back\n", dev->path);
+	bat_init(u);
+	mode_read(u);
+	return 0;
+}
+
+static int daemon_request(int conn)
+{
+	char buf[REQ_MAX], *argv[REQ_MAX / 2 + 1], **args;
+	int argc = 1, n = 0, i, out, err, status = 0, force_req = force;
+	int slot_req = slot, slot_opt = slot;
+	int timeout_req = timeout, timeout_opt = timeout;
+	int debug_req = debug, debug_opt = debug;
+	struct mx_plan plan;
+	jmp_buf jmp;
+	ssize_t res;
+	char *p;
+
+	/* read until the empty terminating string */
+	for (;;) {
+		struct pollfd pfd = { conn, POLLIN, 0 };
+
+		if (poll(&pfd, 1, 1000) <= 0)
+			return -1;
+		res = read(conn, buf + n, sizeof(buf) - n);
+		if (res <= 0)
+			return -1;
+		n += res;
+		if ((n == 1 && buf[0] == '\0') ||
+		    (n > 1 && buf[n-1] == '\0' && buf[n-2] == '\0'))
+			break;
+		if (n == sizeof(buf))
+			return -1;
+	}
+
+	argv[0] = "revoco";
+	for (p = buf; *p; p += strlen(p) + 1)
+		argv[argc++] = p;
+	args = argv;
+	if (argc > 1 && streq(args[1], "--force")) {
+		force_req = 1;
+		++args, --argc;
+	}
+	if (argc > 1 && strneq(args[1], "--slot=", 7)) {
+		slot_req = atoi(args[1] + 7);
+		if (slot_req < SLOT_ALL || slot_req > SLOT_MAX)
+			return -1;
+		++args, --argc;
 	}
-	if (*p)
-		fatal("malformed argument `%s'", str);
-	return i;
+	if (argc > 1 && strneq(args[1], "--timeout=", 10)) {
+		timeout_req = atoi(args[1] + 10);
+		if (timeout_req <= 0)
+			return -1;
+		++args, --argc;
+	}
+	if (argc > 1 && strneq(args[1], "--verbose=", 10)) {
+		debug_req = atoi(args[1] + 10);
+		++args, --argc;
+	}
+	/* a replugged receiver may not have been writable yet on the event */
+	for (i = 0; i < nunits; ++i)
+		if (units[i].dev.fd < 0)
+			unit_reopen(&units[i]);
+
+	fflush(stdout);
+	fflush(stderr);
+	out = dup(1);
+	err = dup(2);
+	dup2(conn, 1);
+	dup2(conn, 2);
+
+	memset(&plan, 0, sizeof(plan));
+	slot = slot_req;
+	timeout = timeout_req;
+	debug = debug_req;
+	if (setjmp(jmp) == 0) {
+		fatal_jmp = &jmp;
+		compile(&plan, argc, args);
+		for (i = 0; i < nunits; ++i) {
+			struct mx_dev *dev = &units[i].dev;
+
+			if (nunits > 1)
+				printf("%s:\n", dev->path);
+			if (dev->fd < 0) {
+				printf("revoco: %s is gone\n", dev->path);
+				status = 1;
+				continue;
+			}
+			/* other processes may have set the wheel since */
+			mx_forget(dev);
+			dev->force = force_req;
+			dev->timeout = timeout_req;
+			dev->debug = debug_req;
+			status |= configure(dev, &plan);
+			dev->force = force;
+			dev->timeout = timeout_opt;
+			dev->debug = debug_opt;
+			unit_update(&units[i], &plan);
+			mx_record_flush(dev);
+		}
+	} else
+		status = 1;
+	fatal_jmp = NULL;
+	slot = slot_opt;
+	timeout = timeout_opt;
+	debug = debug_opt;
+	mx_plan_free(&plan);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(out, 1);
+	dup2(err, 2);
+	close(out);
+	close(err);
+
+	buf[0] = '\0';
+	buf[1] = status;
+	return write_all(conn, buf, 2);
 }
 
-static void configure(int handle, int argc, char **argv)
+/* Open the receivers given, or the one revoco would use. */
+static void daemon_open(const char *recfile)
 {
 	int i;
-	u8 arg1, arg2;
 
-	for (i = 1; i < argc; ++i)
+	nunits = ndevs ? ndevs : 1;
+	units = calloc(nunits, sizeof(*units));
+	if (!units)
+		fatal("out of memory");
+
+	for (i = 0; i < nunits; ++i) {
+		struct mx_dev *dev = &units[i].dev;
+
+		mx_init(dev);
+		dev->debug = debug;
+		dev->timeout = timeout;
+		dev->force = force;
+		if (recfile && mx_record(dev, recfile) < 0)
+			fatal("%s: %s", recfile, strerror(errno));
+		if (ndevs <= 1) {
+			if ((!ndevs || mx_open(dev, devs[0]) < 0) &&
+			    mx_find(dev) < 0)
+				trouble_shooting(dev);
+			continue;
+		}
+		switch (mx_open(dev, devs[i])) {
+		case -1:
+			fatal("%s: %s", devs[i], strerror(errno));
+		case -2:
+			fatal("%s: not a supported receiver", devs[i]);
+		}
+	}
+}
+
+static void daemon_run(const char *path)
+{
+	struct sockaddr_un sun;
+	struct sigaction sa;
+	struct pollfd *pfd;
+	int i, lfd, tfd, ifd, conn;
+
+	path = sock_path(path);
+	if (sock_addr(&sun, path) < 0)
+		fatal("socket path too long: %s", path);
+
+	conn = sock_connect(path);
+	if (conn >= 0)
+		fatal("daemon already running on %s", path);
+	unlink(path);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (lfd < 0)
+		fatal("socket: %s", strerror(errno));
+	if (bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		fatal("bind %s: %s", path, strerror(errno));
+	if (listen(lfd, 16) < 0)
+		fatal("listen: %s", strerror(errno));
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0)
+		fatal("timerfd: %s", strerror(errno));
+	/* keep the identity cache honest for the one-shot runs */
+	ifd = mx_cache_watch();
+	if (ifd < 0 && debug)
+		perror("inotify");
+	pfd = calloc(nunits + 3, sizeof(*pfd));
+	if (!pfd)
+		fatal("out of memory");
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	status_seg = mx_status_create();
+	if (!status_seg)
+		perror("status segment");
+	else if (nunits > STATUS_MAX)
+		fprintf(stderr, "revoco: only the first %d receivers are "
+			"published in the status segment\n", STATUS_MAX);
+	for (i = 0; i < nunits; ++i) {
+		bat_init(&units[i]);
+		mode_read(&units[i]);
+	}
+
+	if (debug)
+		printf("Listening on %s\n", path);
+
+	while (!daemon_quit) {
+		u8 expired[8];
+
+		bat_arm(tfd);
+		pfd[0].fd = lfd;
+		pfd[1].fd = tfd;
+		pfd[2].fd = ifd;
+		for (i = 0; i < nunits; ++i)
+			pfd[i + 3].fd = units[i].dev.fd;
+		for (i = 0; i < nunits + 3; ++i)
+			pfd[i].events = POLLIN;
+		fflush(stdout);
+		if (poll(pfd, nunits + 3, -1) < 0) {
+			if (errno != EINTR)
+				perror("poll");
+			continue;
+		}
+
+		/* notifications, and whatever else the receivers send */
+		for (i = 0; i < nunits; ++i)
+			if (pfd[i + 3].revents &&
+			    mx_process(&units[i].dev) < 0) {
+				printf("%s is gone\n", units[i].dev.path);
+				mx_close(&units[i].dev);
+			}
+
+		if (pfd[1].revents && read(tfd, expired, sizeof(expired)) > 0)
+			bat_poll();
+
+		if (pfd[2].revents && mx_cache_event(ifd) > 0) {
+			if (debug > 1)
+				printf("hidraw nodes changed, "
+				       "identity cache dropped\n");
+			for (i = 0; i < nunits; ++i)
+				if (units[i].dev.fd < 0)
+					unit_reopen(&units[i]);
+		}
+
+		if (pfd[0].revents) {
+			conn = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn < 0) {
+				if (errno != EINTR)
+					perror("accept");
+				continue;
+			}
+			if (daemon_request(conn) < 0 && debug)
+				printf("Dropped malformed request\n");
+			close(conn);
+		}
+	}
+
+	for (i = 0; i < nunits; ++i) {
+		bat_done(&units[i]);
+		if (stats) {
+			if (nunits > 1)
+				printf("%s:\n", units[i].dev.path);
+			mx_print_stats(&units[i].dev);
+		}
+		mx_close(&units[i].dev);
+		mx_record_stop(&units[i].dev);
+	}
+	mx_status_remove(status_seg);
+	if (ifd >= 0)
+		close(ifd);
+	free(pfd);
+	close(tfd);
+	close(lfd);
+	unlink(path);
+}
+
+/*
+ * Print what the daemon last published, without talking to it or to the
+ * devices.
+ */
+static int show_status(void)
+{
+	struct mx_status_dev d[STATUS_MAX];
+	const struct mx_status *st;
+	struct timespec ts;
+	long long now;
+	int i, n;
+
+	st = mx_status_open();
+	if (!st)
+		fatal("no status published, is the daemon running? (%s)",
+		      strerror(errno));
+	n = mx_status_read(st, d, STATUS_MAX);
+	if (n < 0)
+		fatal("status unreadable, restart the daemon (%s)",
+		      strerror(errno));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+
+	for (i = 0; i < n; ++i) {
+		u8 buf[6] = { 0, 0, 0, d[i].battery, 0, d[i].state };
+
+		if (!d[i].updated)
+			continue;
+		printf("%s: ", d[i].path);
+		if (d[i].state)
+			print_battery(buf);
+		else
+			printf("battery unknown\n");
+		printf("%*s  %s, updated %llds ago\n", (int)strlen(d[i].path),
+		       "", !d[i].mode_known ? "wheel mode unknown" :
+		       d[i].mode ? "click-by-click" : "free spinning",
+		       (now - d[i].updated) / 1000000);
+	}
+	return 0;
+}
+
+/*
+ * Configure several receivers at once.  Each one gets a worker process
+ * with its own pipe, so the devices are driven in parallel while the
+ * output is still printed device by device.
+ */
+struct worker {
+	pid_t pid;
+	int fd;
+	char *out;
+	size_t len, size;
+};
+
+static int run_dev(const char *path, struct mx_plan *plan)
+{
+	struct mx_dev dev;
+	int status;
+
+	mx_init(&dev);
+	dev.debug = debug;
+	dev.timeout = timeout;
+	dev.force = force;
+	switch (mx_open(&dev, path)) {
+	case -1:
+		fatal("%s: %s", path, strerror(errno));
+	case -2:
+		fatal("%s: not a supported receiver", path);
+	}
+	status = configure(&dev, plan);
+	if (stats)
+		mx_print_stats(&dev);
+	mx_close(&dev);
+	return status;
+}
+
+static int fan_out(struct mx_plan *plan)
+{
+	struct worker *w;
+	struct pollfd *pfd;
+	int i, n, running = 0, status = 0;
+
+	w = calloc(ndevs, sizeof(*w));
+	pfd = calloc(ndevs, sizeof(*pfd));
+	if (!w || !pfd)
+		fatal("out of memory");
+
+	fflush(stdout);
+	fflush(stderr);
+	for (i = 0; i < ndevs; ++i) {
+		int p[2];
+
+		if (pipe2(p, O_CLOEXEC) < 0)
+			fatal("pipe: %s", strerror(errno));
+		w[i].pid = fork();
+		if (w[i].pid < 0)
+			fatal("fork: %s", strerror(errno));
+		if (w[i].pid == 0) {
+			dup2(p[1], 1);
+			dup2(p[1], 2);
+			exit(run_dev(devs[i], plan));
+		}
+		close(p[1]);
+		w[i].fd = p[0];
+		++running;
+	}
+
+	while (running) {
+		for (i = 0; i < ndevs; ++i) {
+			pfd[i].fd = w[i].fd;
+			pfd[i].events = POLLIN;
+		}
+		if (poll(pfd, ndevs, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll: %s", strerror(errno));
+		}
+		for (i = 0; i < ndevs; ++i) {
+			if (!pfd[i].revents)
+				continue;
+			if (w[i].size - w[i].len < 512) {
+				w[i].size = w[i].size * 2 + 512;
+				w[i].out = realloc(w[i].out, w[i].size);
+				if (!w[i].out)
+					fatal("out of memory");
+			}
+			n = read(w[i].fd, w[i].out + w[i].len,
+				 w[i].size - w[i].len);
+			if (n > 0)
+				w[i].len += n;
+			else if (n == 0 || errno != EINTR) {
+				close(w[i].fd);
+				w[i].fd = -1;
+				--running;
+			}
+		}
+	}
+
+	for (i = 0; i < ndevs; ++i) {
+		int st;
+
+		if (waitpid(w[i].pid, &st, 0) < 0 || !WIFEXITED(st))
+			st = 1;
+		else
+			st = WEXITSTATUS(st);
+		if (st > status)
+			status = st;
+
+		printf("%s:\n", devs[i]);
+		fwrite(w[i].out, 1, w[i].len, stdout);
+		free(w[i].out);
+	}
+	free(w);
+	free(pfd);
+	return status;
+}
+
+/*
+ * Watch mode: apply the commands to the receivers there are, then to
+ * each one plugged in later, as soon as the kernel announces it.  Nodes
+ * that did not change are not looked at again.
+ */
+#define SETTLE_MS	1000	/* for udev to set up a new node */
+
+/*
+ * Open a node that may just have appeared.  Returns like mx_open(),
+ * having told why if the node could not be opened.
+ */
+static int open_settled(struct mx_dev *dev, const char *path)
+{
+	long long until = mx_now() + SETTLE_MS * 1000LL;
+	int res;
+
+	mx_init(dev);
+	dev->debug = debug;
+	dev->timeout = timeout;
+	dev->force = force;
+	while ((res = mx_open(dev, path)) == -1 &&
+	       (errno == ENOENT || errno == EACCES || errno == EPERM) &&
+	       mx_now() < until)
+		usleep(10000);
+	if (res == -1)
+		fprintf(stderr, "revoco: %s: %s\n", path, strerror(errno));
+	return res;
+}
+
+static int apply(const char *path, struct mx_plan *plan)
+{
+	struct mx_dev dev;
+	long long start = mx_now();
+	int res, status;
+
+	res = open_settled(&dev, path);
+	if (res < 0)
+		return res == -2 ? 0 : 1;
+
+	printf("%s:\n", path);
+	status = configure(&dev, plan);
+	if (debug)
+		printf("applied in %lldms\n", (mx_now() - start) / 1000);
+	fflush(stdout);
+	mx_close(&dev);
+	return status;
+}
+
+/* Run fn() on every receiver there is or that gets plugged in. */
+static void watch(struct mx_plan *plan,
+		  int (*fn)(const char *path, struct mx_plan *plan))
+{
+	struct sigaction sa;
+	char path[512];
+	int fd, i, given = ndevs;
+
+	fd = mx_hotplug_open();
+	if (fd < 0)
+		fatal("hotplug events: %s", strerror(errno));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (!given)
+		all_devs();
+	for (i = 0; i < ndevs; ++i)
+		fn(devs[i], plan);
+
+	while (!daemon_quit) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		char *name;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("poll: %s", strerror(errno));
+		}
+
+		switch (mx_hotplug_read(fd, path, sizeof(path))) {
+		case HP_ADD:
+			mx_cache_drop();
+			/* only the nodes asked for, if any */
+			for (i = 0; i < given && !streq(devs[i], path); ++i)
+				;
+			if (given && i == given)
+				break;
+			name = strrchr(path, '/') + 1;
+			if (mx_check(name) == 0) {
+				if (debug > 1)
+					printf("Ignoring %s\n", path);
+				break;
+			}
+			fn(path, plan);
+			break;
+		case HP_REMOVE:
+			mx_cache_drop();
+			if (debug)
+				printf("%s removed\n", path);
+			break;
+		case -1:
+			fatal("hotplug events: %s", strerror(errno));
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Provisioning station: apply a profile, a file of verbs, to every
+ * receiver that shows up, with the wheel mode (register 0x08) read back
+ * in the same batch as the writes, and print one JSON record per
+ * device.  The writes are forced, whatever the mouse had before.
+ */
+#define PROFILE_MAX	64
+
+static int prov_done, prov_failed;
+static long long prov_start, prov_end;	/* first and last receiver */
+
+static void json_str(const char *key, const char *s)
+{
+	printf("\"%s\":\"", key);
+	for (; *s; ++s)
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	printf("\"");
+}
+
+/* Mode the wheel steps should leave register 0x08 in, -1 if any. */
+static int expected_mode(const struct mx_plan *plan)
+{
+	int i, mode = -1;
+
+	for (i = 0; i < plan->n; ++i)
+		if (plan->step[i].verb == V_WHEEL)
+			switch (plan->step[i].q.val[0] & 0x0f) {
+			case 1:
+				mode = 0;
+				break;
+			case 2:
+				mode = 1;
+				break;
+			default:
+				mode = -1;
+			}
+	return mode;
+}
+
+static int provision_one(const char *path, struct mx_plan *plan)
+{
+	const struct mx_step *st, *check = &plan->step[plan->n - 1];
+	char serial[64], when[32], error[64] = "";
+	struct mx_dev dev;
+	long long start = mx_now();
+	int i, mode, want, ok;
+	time_t now;
+
+	i = open_settled(&dev, path);
+	if (i == -2)
+		return 0;
+	if (i < 0)
+		snprintf(error, sizeof(error), "%s", strerror(errno));
+	if (!prov_start)
+		prov_start = start;
+
+	for (i = 0; dev.fd >= 0 && i < plan->n; )
+		i = mx_plan_run(&dev, plan, i);
+
+	/* the first step that failed tells */
+	for (i = 0; !error[0] && i < plan->n; ++i) {
+		st = &plan->step[i];
+		if (st->q.state == Q_TIMEOUT)
+			snprintf(error, sizeof(error),
+				 "register %02x: no answer", st->q.reg);
+		else if (st->q.state != Q_DONE)
+			snprintf(error, sizeof(error),
+				 "register %02x: error %02x", st->q.reg,
+				 st->q.res[4]);
+	}
+	want = expected_mode(plan);
+	mode = dev.fd >= 0 && check->q.state == Q_DONE ?
+		check->q.res[5] & 1 : -1;
+	if (!error[0] && want >= 0 && mode != want)
+		snprintf(error, sizeof(error), "read back %s",
+			 mode ? "click-by-click" : "free spinning");
+	ok = !error[0];
+
+	++prov_done;
+	prov_failed += !ok;
+	prov_end = mx_now();
+	now = time(NULL);
+	strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	if (dev.fd < 0 || mx_serial(&dev, serial, sizeof(serial)) < 0)
+		serial[0] = '\0';
+
+	printf("{");
+	json_str("time", when);
+	printf(",");
+	json_str("device", path);
+	printf(",\"product\":\"%04hx\",", dev.product);
+	json_str("serial", serial);
+	printf(",\"ok\":%s", ok ? "true" : "false");
+	if (mode >= 0)
+		printf(",\"mode\":\"%s\"", mode ? "click" : "free");
+	if (!ok) {
+		printf(",");
+		json_str("error", error);
+	}
+	printf(",\"ms\":%lld}\n", (mx_now() - start) / 1000);
+	fflush(stdout);
+
+	if (dev.fd >= 0)
+		mx_close(&dev);
+	return !ok;
+}
+
+/* Split the profile into verbs; '#' starts a comment. */
+static int load_profile(const char *path, char **argv, int max)
+{
+	char line[512], *p;
+	int n = 0;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f)
+		fatal("%s: %s", path, strerror(errno));
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#")] = '\0';
+		for (p = strtok(line, " \t\n"); p; p = strtok(NULL, " \t\n")) {
+			if (n == max)
+				fatal("%s: too many verbs", path);
+			argv[n++] = strdup(p);
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+static int provision(const char *profile)
+{
+	char *argv[PROFILE_MAX + 2];
+	struct mx_plan plan;
+	long long t;
+	int i, argc = 1;
+
+	argv[0] = "revoco";
+	argc += load_profile(profile, argv + 1, PROFILE_MAX);
+	if (argc == 1)
+		fatal("%s: no verbs", profile);
+	argv[argc++] = "mode";
+	compile(&plan, argc, argv);
+
+	force = 1;
+	watch(&plan, provision_one);
+
+	t = prov_end - prov_start;
+	fprintf(stderr, "revoco: provisioned %d receivers, %d failed",
+		prov_done, prov_failed);
+	if (prov_done > 1 && t > 0)
+		fprintf(stderr, ", %.1f per minute", prov_done * 60e6 / t);
+	fprintf(stderr, "\n");
+
+	for (i = 1; i < argc - 1; ++i)
+		free(argv[i]);
+	mx_plan_free(&plan);
+	return prov_failed != 0;
+}
+
+/*
+ * Battery watch.  The device is asked to report battery changes on its
+ * own (HID++ reporting flags, register 0x00), so an idle system sees no
+ * traffic at all; devices that cannot do that are polled instead.
+ */
+static u8 battery_last[4];
+
+/* Register 0x07 (level and charging), without the report id. */
+static void print_battery_status(const u8 *buf)
+{
+	static const char *level[8] = {
+		"unknown", "critical", "critical", "low",
+		"low", "good", "good", "full"
+	};
+	char str[32] = { 0 }, *st;
+
+	switch (buf[4])
 	{
-		u8 perm = 0x80;
-		char *cmd = argv[i];
-
-		if (strneq(cmd, "temp-", 5))
-			perm = 0, cmd += 5;
-
-		if (streq(cmd, "free"))
-		{
-			mx_cmd(handle, perm + 1, 0, 0);
-		}
-		else if (streq(cmd, "click"))
-		{
-			mx_cmd(handle, perm + 2, 0, 0);
-		}
-		else if (strneq(cmd, "manual", 6))
-		{
-			twoargs(cmd + 6, &arg1, &arg2, 0, 0, 15);
-			if (arg1 != arg2)
-				mx_cmd(handle, perm + 7, arg1 * 16 + arg2, 0);
-			else
-				mx_cmd(handle, perm + 8, arg1, 0);
-		}
-		else if (strneq(cmd, "auto", 4))
-		{
-			twoargs(cmd + 4, &arg1, &arg2, 0, 0, 50);
-			mx_cmd(handle, perm + 5, arg1, arg2);
-		}
-		else if (strneq(argv[i], "soft-free", 9))
-		{
-			twoargs(argv[i] + 9, &arg1, &arg2, 0, 0, 255);
-			mx_cmd(handle, 3, arg1, arg2);
-		}
-		else if (strneq(argv[i], "soft-click", 10))
-		{
-			twoargs(argv[i] + 10, &arg1, &arg2, 0, 0, 255);
-			mx_cmd(handle, 4, arg1, arg2);
-		}
-		else if (strneq(argv[i], "reconnect", 9))
-		{
-			static const u8 cmd[] = { 0xff, 0x80, 0xb2, 1, 0, 0 };
-
-			twoargs(argv[i] + 9, &arg1, &arg2, 0, 0, 255);
-			send_report(handle, 0x10, cmd, 6);
-			printf("Reconnection initiated\n");
-			printf(" - Turn off the mouse\n");
-			printf(" - Press and hold the left mouse button\n");
-			printf(" - Turn on the mouse\n");
-			printf(" - Press the right button 5 times\n");
-			printf(" - Release the left mouse button\n");
-		}
-		else if (strneq(argv[i], "mode", 4))
-		{
-			u8 buf[6] = { 0 };
-
-			if (mx_query(handle, 0x08, buf))
-			{
-				if (buf[5] & 1)
-					printf("click-by-click\n");
-			else
-				printf("free spinning\n");
+		case 0x00:	st = "running on battery";	break;
+		case 0x21:
+		case 0x22:	st = "charging";		break;
+		case 0x23:	st = "fully charged";		break;
+		default:	sprintf(st = str, "status %02x", buf[4]);
+	}
+	printf("battery %s, %s\n", level[buf[3] & 7], st);
+}
+
+static void battery_changed(const u8 *buf)
+{
+	if (battery_last[0] == buf[2] && !memcmp(battery_last + 1, buf + 3, 3))
+		return;
+	battery_last[0] = buf[2];
+	memcpy(battery_last + 1, buf + 3, 3);
+
+	if (buf[2] == 0x07)
+		print_battery_status(buf);
+	else
+		print_battery(buf);
+	fflush(stdout);
+}
+
+/*
+ * A notification carries the register's value right after its sub-id,
+ * which is the register number: [id idx sub r0 r1 r2].
+ */
+static void battery_notify(struct mx_dev *dev, const u8 *rep, int len)
+{
+	u8 level, state;
+
+	++dev->rx_notify;
+	if (battery_parse(dev, rep, &level, &state)) {
+		u8 buf[6] = { rep[1], 0x81, rep[2], rep[3], rep[4], rep[5] };
+
+		battery_changed(buf);
+	} else if (debug > 1)
+		printf("notification %02x from device %d\n", rep[2], rep[1]);
+}
+
+static int watch_battery(struct mx_dev *dev, int interval)
+{
+	struct sigaction sa;
+	struct query q;
+	u8 res[6], flags[3];
+	long long next = 0;
+	int notify = 0, status = 0;
+
+	dev->notify_handler = battery_notify;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* through the battery feature on a HID++ 2.0 mouse */
+	dev_read(dev, "battery", &q);
+	if (q.state == Q_DONE)
+		battery_changed(q.res);
+
+	if (mx_query(dev, 0x00, res) == 1) {
+		memcpy(flags, res + 3, 3);
+		memset(&q, 0, sizeof(q));
+		q.idx = dev->idx;
+		q.sub = 0x80;
+		q.reg = 0x00;
+		memcpy(q.val, flags, 3);
+		q.val[0] |= NOTIFY_BATTERY;
+		notify = mx_query_many(dev, &q, 1) == 1;
+	}
+	if (debug)
+		printf(notify ? "Battery notifications enabled\n" :
+		       "Polling the battery every %ds\n", interval);
+
+	while (!daemon_quit) {
+		struct pollfd pfd = { mx_fd(dev), POLLIN, 0 };
+		long long now = mx_now();
+		int wait = -1;
+
+		if (!notify) {
+			if (!next || now >= next) {
+				struct query b;
+
+				dev_read(dev, "battery", &b);
+				if (b.state == Q_DONE)
+					battery_changed(b.res);
+				next = mx_now() + interval * 1000000LL;
 			}
+			wait = (next - mx_now() + 999) / 1000;
 		}
-		else if (strneq(argv[i], "battery", 7))
-		{
-			u8 buf[6] = { 0 };
-
-			if (mx_query(handle, 0x0d, buf))
-			{
-				char str[32] = { 0 }, *st;
-
-				switch (buf[5])
-				{
-					case 0x30:	st = "running on battery";	break;
-					case 0x50:	st = "charging";		break;
-					case 0x90:	st = "fully charged";		break;
-					case 0xd0:	st = "battery bad";		break;
-					default:	sprintf(st = str, "status %02x", buf[5]);
-				}
-				printf("battery level %d%%, %s\n", buf[3], st);
+		if (poll(&pfd, 1, wait) < 0 && errno != EINTR)
+			fatal("poll: %s", strerror(errno));
+		if (pfd.revents && mx_process(dev) < 0) {
+			fprintf(stderr, "revoco: %s is gone\n", dev->path);
+			status = 1;
+			break;
+		}
+	}
+
+	/* leave the reporting flags as they were */
+	if (notify && !status) {
+		memcpy(q.val, flags, 3);
+		mx_query_many(dev, &q, 1);
+	}
+	return status;
+}
+
+/*
+ * Traffic logs (--record).  A log is mapped and indexed once; each
+ * request sent is paired with the reply it got, the way take_replies()
+ * would have matched them.  A request sent again before its reply came
+ * is a retransmission and gives no latency sample.
+ */
+struct frame {
+	long long t;
+	u8 dir, len;
+	const u8 *data;
+	int reply;		/* frame that answered it, or -1 */
+	int resent;		/* last frame that sent it again, or 0 */
+	u8 retry;		/* retransmission of an earlier request */
+};
+
+struct log {
+	u8 *map;
+	size_t size;
+	int n;
+	struct frame *f;
+};
+
+static int is_request(const struct frame *f)
+{
+	return f->dir == REC_TX && f->len >= 7 &&
+	       (f->data[0] == 0x10 || f->data[0] == 0x11) && f->data[2] & 0x80;
+}
+
+static int is_reply(const struct frame *f)
+{
+	return f->dir == REC_RX && f->len >= 7 &&
+	       (f->data[0] == 0x10 || f->data[0] == 0x11) && f->data[2] & 0x80;
+}
+
+static int answers(const struct frame *req, const struct frame *rep)
+{
+	u8 sub = rep->data[2], reg = rep->data[3];
+
+	if (sub == 0x8f)
+		sub = rep->data[3], reg = rep->data[4];
+	return req->data[2] == sub && req->data[3] == reg &&
+	       (req->data[1] == rep->data[1] || rep->data[1] <= 0x02);
+}
+
+static void load_log(struct log *log, const char *path)
+{
+	struct stat st;
+	size_t off;
+	int fd, i, j;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		fatal("%s: %s", path, strerror(errno));
+	log->size = st.st_size;
+	if (log->size < REC_MAGIC_LEN)
+		fatal("%s: not a revoco log", path);
+	log->map = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (log->map == MAP_FAILED)
+		fatal("%s: %s", path, strerror(errno));
+	if (memcmp(log->map, REC_MAGIC, REC_MAGIC_LEN))
+		fatal("%s: not a revoco log", path);
+
+	log->n = 0;
+	for (off = REC_MAGIC_LEN; off + REC_HDR <= log->size;
+	     off += REC_HDR + log->map[off + 9])
+		++log->n;
+	log->f = calloc(log->n + 1, sizeof(*log->f));
+	if (!log->f)
+		fatal("out of memory");
+
+	log->n = 0;
+	for (off = REC_MAGIC_LEN; off + REC_HDR <= log->size;
+	     off += REC_HDR + log->map[off + 9]) {
+		struct frame *f = &log->f[log->n];
+
+		if (off + REC_HDR + log->map[off + 9] > log->size)
+			break;
+		memcpy(&f->t, log->map + off, 8);
+		f->dir = log->map[off + 8];
+		f->len = log->map[off + 9];
+		f->data = log->map + off + REC_HDR;
+		f->reply = -1;
+		++log->n;
+	}
+
+	/* pair replies with the earliest request they can answer */
+	for (i = 0; i < log->n; ++i) {
+		if (!is_reply(&log->f[i]))
+			continue;
+		for (j = 0; j < i; ++j) {
+			struct frame *f = &log->f[j];
+
+			if (is_request(f) && f->reply < 0 && answers(f, &log->f[i])) {
+				f->reply = i;
+				break;
 			}
 		}
+	}
+	/*
+	 * An unanswered copy of a request sent while the original was still
+	 * waiting for its reply is a retransmission; the reply, if any,
+	 * went to the original.
+	 */
+	for (i = 0; i < log->n; ++i) {
+		struct frame *g = &log->f[i];
+
+		if (!is_request(g) || g->reply >= 0)
+			continue;
+		for (j = i - 1; j >= 0; --j) {
+			struct frame *f = &log->f[j];
+
+			if (is_request(f) && !f->retry && f->len == g->len &&
+			    !memcmp(f->data, g->data, g->len) &&
+			    (f->reply < 0 || f->reply > i)) {
+				g->retry = 1;
+				f->resent = i;
+				break;
+			}
+		}
+	}
+}
+
+static void free_log(struct log *log)
+{
+	munmap(log->map, log->size);
+	free(log->f);
+}
+
+static int kind(const u8 *req)
+{
+	if (req[1] == 0xff && req[2] == 0x80 && req[3] == 0xb2)
+		return S_RECONNECT;
+	return req[2] & 1 ? S_GET : S_SET;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int analyze(const char *path)
+{
+	static const char *name[S_MAX] = {
+		"set register", "get register", "reconnect", "raw"
+	};
+	unsigned tx = 0, rx = 0, input = 0, notify = 0, errors = 0,
+		 lost = 0, retries = 0;
+	long long *lat[S_MAX];
+	int nlat[S_MAX] = { 0 };
+	struct log log;
+	int i, k;
+
+	load_log(&log, path);
+	for (k = 0; k < S_MAX; ++k)
+		if (!(lat[k] = calloc(log.n + 1, sizeof(long long))))
+			fatal("out of memory");
+
+	for (i = 0; i < log.n; ++i) {
+		struct frame *f = &log.f[i];
+
+		if (f->dir == REC_RX) {
+			++rx;
+			if (f->len < 7 || (f->data[0] != 0x10 && f->data[0] != 0x11))
+				++input;
+			else if (!(f->data[2] & 0x80))
+				++notify;
+			else if (f->data[2] == 0x8f)
+				++errors;
+			continue;
+		}
+		++tx;
+		if (!is_request(f))
+			continue;
+		if (f->retry) {
+			++retries;
+			continue;
+		}
+		if (f->reply < 0)
+			++lost;
+		else if (!f->resent) {
+			k = kind(f->data);
+			lat[k][nlat[k]++] = log.f[f->reply].t - f->t;
+		}
+	}
 
-		/*** debug commands ***/
-		else if (strneq(argv[i], "raw", 3))
-		{
-			u8 buf[256] = { 0 }, n;
+	printf("%s: %d frames", path, log.n);
+	if (log.n)
+		printf(" over %.3fs", (log.f[log.n-1].t - log.f[0].t) / 1e6);
+	printf("\n");
+	printf("sent %u, received %u (%u input, %u notifications, "
+	       "%u error replies)\n", tx, rx, input, notify, errors);
+	printf("retransmissions %u, unanswered %u\n", retries, lost);
+	for (k = 0; k < S_MAX; ++k) {
+		long long *t = lat[k];
+		int n = nlat[k];
+
+		if (n) {
+			qsort(t, n, sizeof(*t), cmp_ll);
+			printf("%s: %d, p50 %lldus, p99 %lldus, max %lldus\n",
+			       name[k], n, t[n / 2], t[(n * 99) / 100], t[n - 1]);
+		}
+		free(t);
+	}
+	free_log(&log);
+	return 0;
+}
 
-			n = nargs(argv[i] + 3, buf, 256, 0, 0, 255);
-			send_report(handle, buf[0], buf+1, n-1);
+/*
+ * Send the requests of a log to a device again, keeping their timing,
+ * and compare the answers with the recorded ones.  Resent copies are
+ * left out, the query engine retries on its own.
+ */
+static int replay(struct mx_dev *dev, const char *path)
+{
+	struct query *q;
+	struct log log;
+	long long start, first = -1;
+	int i, n = 0, same = 0, differ = 0;
+
+	load_log(&log, path);
+	q = calloc(log.n + 1, sizeof(*q));
+	if (!q)
+		fatal("out of memory");
+
+	start = mx_now();
+	for (i = 0; i < log.n; ++i) {
+		struct frame *f = &log.f[i];
+		long long due;
+
+		if (f->dir != REC_TX || f->retry)
+			continue;
+		if (first < 0)
+			first = f->t;
+		due = start + f->t - first;
+		while (mx_now() < due || dev->ninflight == INFLIGHT_MAX) {
+			struct pollfd pfd = { mx_fd(dev), POLLIN, 0 };
+			long long wait = (due - mx_now() + 999) / 1000;
+			int t = mx_timeout(dev);
+
+			if (wait < 0)
+				wait = 0;
+			if (t < 0 || (dev->ninflight < INFLIGHT_MAX && wait < t))
+				t = wait;
+			poll(&pfd, 1, t);
+			if (mx_process(dev) < 0)
+				fatal("%s: device gone", dev->path);
 		}
-		else if (strneq(argv[i], "query", 5))
-		{
-			u8 buf[256] = { 0 }, j;
 
-			twoargs(argv[i] + 5, &arg1, &arg2, -1, 0, 255);
-			if (arg1 == -1)
-				arg1 = 0x10, arg2 = 6;
-			query_report(handle, arg1, buf, arg2);
+		if (!is_request(f) || f->len != mx_report_len(f->data[0])) {
+			mx_send(dev, f->data, f->len);
+			continue;
+		}
+		q[i].idx = f->data[1];
+		q[i].sub = f->data[2];
+		q[i].reg = f->data[3];
+		memcpy(q[i].val, f->data + 4,
+		       f->len - 4 < LONG_VAL ? f->len - 4 : LONG_VAL);
+		mx_submit(dev, &q[i]);
+	}
+	mx_flush(dev);
 
-			printf("report %02x:", arg1);
-			for (j = 0; j < arg2; ++j)
-				printf(" %02x", buf[j]);
-			printf("\n");
+	for (i = 0; i < log.n; ++i) {
+		struct frame *f = &log.f[i];
+		int ok;
+
+		if (!q[i].sub)
+			continue;
+		++n;
+		if (f->reply < 0)
+			ok = q[i].state == Q_TIMEOUT;
+		else
+			ok = q[i].state != Q_TIMEOUT &&
+			     q[i].len == log.f[f->reply].len - 1 &&
+			     !memcmp(q[i].res, log.f[f->reply].data + 1, q[i].len);
+		if (ok) {
+			++same;
+			continue;
 		}
-		else if (strneq(argv[i], "sleep", 5))
-		{
-			twoargs(argv[i] + 5, &arg1, &arg2, 1, 0, 255);
-			sleep(arg1);
+		++differ;
+		printf("frame %d: %02x %02x %02x %02x:", i,
+		       f->data[1], f->data[2], f->data[3], f->data[4]);
+		if (f->reply < 0)
+			printf(" no reply recorded,");
+		else {
+			const u8 *r = log.f[f->reply].data + 1;
+
+			printf(" recorded %02x %02x %02x %02x %02x %02x,",
+			       r[0], r[1], r[2], r[3], r[4], r[5]);
 		}
+		if (q[i].state == Q_TIMEOUT)
+			printf(" got no answer\n");
 		else
-			fatal("unknown option `%s'", argv[i]);
+			printf(" got %02x %02x %02x %02x %02x %02x\n",
+			       q[i].res[0], q[i].res[1], q[i].res[2],
+			       q[i].res[3], q[i].res[4], q[i].res[5]);
+	}
+	printf("replayed %d requests: %d as recorded, %d differ\n",
+	       n, same, differ);
+
+	free(q);
+	free_log(&log);
+	return differ != 0;
+}
+
+/*
+ * Stress test: offer register traffic at doubling rates, STRESS_SECS
+ * seconds each, and report for each rate how much of it got through and
+ * how long it took.  Requests go out on schedule whether or not the
+ * earlier ones were answered (up to INFLIGHT_MAX of them), as a busy
+ * program would send them.  The knee is the highest rate at which the
+ * receiver still answers nearly everything, keeps up, and does not
+ * keep the slow requests waiting much longer than at the lowest rate.
+ */
+#define STRESS_FIRST	25	/* commands per second */
+#define STRESS_MAX	3200
+#define STRESS_SECS	2
+#define STRESS_OK	99	/* percent answered */
+#define STRESS_KEEP	90	/* percent of the offered rate completed */
+#define STRESS_SLOW	4	/* p99 over the p90 of the first rate */
+#define STRESS_FLOOR	1000	/* microseconds, a USB frame; less is noise */
+
+static void stress_done(struct mx_dev *dev, struct query *q)
+{
+	*(long long *)q->arg = mx_now() - q->start;
+}
+
+/* One rate; returns 0 if the receiver coped, and why not otherwise. */
+static const char *stress_rate(struct mx_dev *dev, int rate,
+			       const struct query *mix, int nmix,
+			       long long *base)
+{
+	int i, n = rate * STRESS_SECS, ok = 0, timeouts = 0, busy = 0;
+	unsigned codes[256] = { 0 }, retries;
+	long long start, end, *lat;
+	const char *why = NULL;
+	struct query *q;
+	double done;
+
+	q = calloc(n, sizeof(*q));
+	lat = calloc(n, sizeof(*lat));
+	if (!q || !lat)
+		fatal("out of memory");
+	retries = dev->stat[S_SET].retries + dev->stat[S_GET].retries;
+
+	start = mx_now();
+	for (i = 0; i < n; ++i) {
+		long long due = start + i * 1000000LL / rate;
+
+		while (mx_now() < due) {
+			struct pollfd pfd = { mx_fd(dev), POLLIN, 0 };
+			long long wait = (due - mx_now() + 999) / 1000;
+			int t = mx_timeout(dev);
+
+			if (t < 0 || wait < t)
+				t = wait;
+			poll(&pfd, 1, t);
+			if (mx_process(dev) < 0)
+				fatal("%s: device gone", dev->path);
+		}
+		q[i] = mix[i % nmix];
+		q[i].done = stress_done;
+		q[i].arg = &lat[i];
+		if (mx_submit(dev, &q[i]) < 0) {
+			/* the request is not sent, so it is not timed */
+			q[i].state = Q_ERROR;
+			++busy;
+		}
 	}
+	mx_flush(dev);
+	end = mx_now();
+	if (end - start < n * 1000000LL / rate)
+		end = start + n * 1000000LL / rate;
+	retries = dev->stat[S_SET].retries + dev->stat[S_GET].retries - retries;
+
+	for (i = 0; i < n; ++i) {
+		if (q[i].state == Q_DONE)
+			lat[ok++] = lat[i];
+		else if (q[i].state == Q_TIMEOUT)
+			++timeouts;
+		else if (q[i].len && q[i].res[1] == 0x8f)
+			++codes[q[i].res[4]];
+	}
+	done = ok * 1e6 / (end - start);
+
+	printf("%7d %9.0f %6.1f%%", rate, done, ok * 100.0 / n);
+	if (ok) {
+		qsort(lat, ok, sizeof(*lat), cmp_ll);
+		printf(" %8lld %8lld %8lld %8lld", lat[ok / 2],
+		       lat[(ok * 90) / 100], lat[(ok * 99) / 100], lat[ok - 1]);
+		if (*base < 0)
+			*base = lat[(ok * 90) / 100] > STRESS_FLOOR ?
+				lat[(ok * 90) / 100] : STRESS_FLOOR;
+	} else
+		printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+	printf(" %7u", retries);
+	if (timeouts)
+		printf("  %d timed out", timeouts);
+	if (busy)
+		printf("  %d not sent", busy);
+	for (i = 0; i < 256; ++i)
+		if (codes[i])
+			printf("  error %02x x%u", i, codes[i]);
+	printf("\n");
+
+	if (ok * 100 < n * STRESS_OK)
+		why = "requests failed";
+	else if (done * 100 < rate * STRESS_KEEP)
+		why = "fell behind";
+	else if (*base >= 0 && ok && lat[(ok * 99) / 100] > *base * STRESS_SLOW)
+		why = "latency rose";
+
+	free(lat);
+	free(q);
+	return why;
+}
+
+static int stress(struct mx_dev *dev, int max)
+{
+	struct query mix[2];
+	long long base = -1;
+	int nmix = 0, rate, knee = 0, first_bad = 0;
+	const char *why = NULL;
+	u8 res[6];
+
+	/*
+	 * Battery reads, and writes of the wheel mode the mouse already
+	 * has, as a temporary setting, where the receiver has them.
+	 */
+	memset(mix, 0, sizeof(mix));
+	if (mx_query(dev, 0x0d, res) == 1) {
+		mix[nmix].idx = dev->idx;
+		mix[nmix].sub = 0x81;
+		mix[nmix++].reg = 0x0d;
+	}
+	if (mx_query(dev, 0x56, res) == 1) {
+		mix[nmix].idx = dev->idx;
+		mix[nmix].sub = 0x80;
+		mix[nmix].reg = 0x56;
+		memcpy(mix[nmix].val, res + 3, 3);
+		mix[nmix++].val[0] &= 0x7f;
+	}
+	if (!nmix)
+		fatal("%s: neither register 0x0d nor 0x56 answers", dev->path);
+
+	printf("%s: %s, %ds per rate\n\n", dev->path,
+	       nmix == 2 ? "battery reads and wheel mode writes" :
+	       mix[0].reg == 0x0d ? "battery reads" : "wheel mode writes",
+	       STRESS_SECS);
+	printf("%7s %9s %7s %8s %8s %8s %8s %7s\n", "offered", "completed",
+	       "ok", "p50us", "p90us", "p99us", "maxus", "retries");
+
+	for (rate = STRESS_FIRST; rate <= max; rate *= 2) {
+		const char *bad = stress_rate(dev, rate, mix, nmix, &base);
+
+		if (!bad) {
+			if (!first_bad)
+				knee = rate;
+			continue;
+		}
+		if (first_bad)
+			break;	/* twice in a row, no need to go on */
+		first_bad = rate;
+		why = bad;
+	}
+
+	printf("\n");
+	if (!first_bad)
+		printf("knee: none up to %d commands/s\n", rate / 2);
+	else if (!knee)
+		printf("knee: below %d commands/s (%s)\n", first_bad, why);
+	else
+		printf("knee: %d commands/s (%s at %d)\n", knee, why, first_bad);
+	return 0;
 }
 
 static void usage(void)
@@ -436,6 +2218,35 @@ static void usage(void)
 	printf("  revoco battery                   query battery status\n");
 	printf("  revoco mode                      query scroll wheel mode\n");
 	printf("  revoco reconnect                 initiate reconnection\n");
+	printf("  revoco stats                     command counts and latencies\n");
+	printf("  revoco list                      devices paired to the receiver\n");
+	printf("  revoco watch battery[=SECONDS]   print battery changes as they happen\n");
+	printf("                                   (polled every SECONDS if need be)\n");
+	printf("  revoco analyze FILE              latencies in a --record log\n");
+	printf("  revoco replay FILE               send the requests of a log again\n");
+	printf("                                   and compare the answers\n");
+	printf("  revoco stress [MAX]              offer commands at rising rates, up\n");
+	printf("                                   to MAX a second, and find the knee\n");
+	printf("  revoco --daemon                  keep the receiver open and serve\n");
+	printf("                                   the commands above over a socket\n");
+	printf("  revoco status                    battery and wheel mode as last seen\n");
+	printf("                                   by the daemon\n");
+	printf("  revoco provision PROFILE         apply the verbs in PROFILE to every\n");
+	printf("                                   receiver plugged in, and log them\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -a, --all                        configure every receiver found\n");
+	printf("  -d, --device=PATH[,PATH...]      use these hidraw nodes\n");
+	printf("  -f, --force                      write the wheel mode even if the\n");
+	printf("                                   mouse already has it\n");
+	printf("  -i, --slot=N|all                 talk to paired device N (1-6), or\n");
+	printf("                                   to every paired device\n");
+	printf("  -r, --record=FILE                append all reports to a log\n");
+	printf("  -S, --stats                      print statistics when done\n");
+	printf("  -t, --timeout=MS                 give up on a command after MS\n");
+	printf("                                   milliseconds (default 2000)\n");
+	printf("  -w, --watch                      keep running and apply the commands\n");
+	printf("                                   to every receiver plugged in\n");
 	printf("\n");
 	printf("Prefixing the mode with 'temp-' (i.e. temp-free) switches the mode\n");
 	printf("temporarily, otherwise it becomes the default mode after power up.\n");
@@ -450,11 +2261,15 @@ static void usage(void)
 	exit(0);
 }
 
-static void trouble_shooting(void)
+static void trouble_shooting(struct mx_dev *dev)
 {
 	char *path;
 	int fd;
 
+	if (dev && (errno == EPERM || errno == EACCES))
+		fatal("No permission to access %s\n"
+		"Try 'sudo revoco ...'", dev->path);
+
 	fd = open(path = "/dev/hidraw0", O_RDWR);
 	if (fd == -1 && errno == ENOENT)
 		fd = open(path = "/dev/usb/hidraw0", O_RDWR);
@@ -478,27 +2293,75 @@ static void trouble_shooting(void)
 
 int main(int argc, char **argv)
 {
-	int handle = -1;
-	int opt;
-	char *filename = NULL;
+	struct mx_dev dev;
+	struct mx_plan plan;
+	int status = 0;
+	int opt, daemon_mode = 0, all = 0, watch_mode = 0;
+	char *filename = NULL, *sockname = NULL, *recfile = NULL;
+	char *replay_file = NULL;
+	int battery_interval = 0, stress_max = 0;
 
 	if (argc < 2)
 		usage();
 
 	static struct option long_options[] = {
 	    {"help",	no_argument,		0, 'h'},
+	    {"all",	no_argument,		0, 'a'},
 	    {"device",	required_argument,	0, 'd'},
+	    {"daemon",	no_argument,		0, 'D'},
+	    {"force",	no_argument,		0, 'f'},
+	    {"slot",	required_argument,	0, 'i'},
+	    {"record",	required_argument,	0, 'r'},
+	    {"socket",	required_argument,	0, 's'},
+	    {"stats",	no_argument,		0, 'S'},
+	    {"timeout",	required_argument,	0, 't'},
 	    {"verbose",	no_argument,		0, 'v'},
+	    {"watch",	no_argument,		0, 'w'},
 	    {0,		0,			0, 0}
 	};
 
 	do {
-		opt = getopt_long(argc, argv, "d:hv",
+		opt = getopt_long(argc, argv, "ad:Dfhi:r:s:St:vw",
 				  long_options, NULL);
 
 		switch (opt) {
+		case 'a':
+			all = 1;
+			break;
 		case 'd':
-			filename = optarg;
+			for (filename = strtok(optarg, ","); filename;
+			     filename = strtok(NULL, ","))
+				add_dev(filename, NULL);
+			break;
+		case 'D':
+			daemon_mode = 1;
+			break;
+		case 'f':
+			force = 1;
+			break;
+		case 'i':
+			if (streq(optarg, "all"))
+				slot = SLOT_ALL;
+			else {
+				slot = atoi(optarg);
+				if (slot < 1 || slot > SLOT_MAX)
+					fatal("bad slot `%s'", optarg);
+			}
+			break;
+		case 'r':
+			recfile = optarg;
+			break;
+		case 's':
+			sockname = optarg;
+			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			if (timeout <= 0)
+				fatal("bad timeout `%s'", optarg);
+			timeout_set = 1;
 			break;
 		case 'h':
 			usage();
@@ -506,6 +2369,9 @@ int main(int argc, char **argv)
 		case 'v':
 			++debug;
 			break;
+		case 'w':
+			watch_mode = 1;
+			break;
 		case -1: break;
 		default:
 			fprintf(stderr, "revoco: Option %d(%c) not understood\n",
@@ -514,48 +2380,121 @@ int main(int argc, char **argv)
 		}
 	} while (opt >= 0);
 
-	if (filename) {
-		handle = open(filename, O_RDWR);
-		if (handle >= 0) {
-			if (check_dev(handle) < 0) {
-				filename = NULL;
-				handle = -1;
-				close(handle);
-			}
-		}
+	/* traffic logs */
+	if (optind < argc && (streq(argv[optind], "analyze") ||
+			      streq(argv[optind], "replay"))) {
+		if (argc - optind != 2)
+			fatal("usage: revoco %s FILE", argv[optind]);
+		if (streq(argv[optind], "analyze"))
+			exit(analyze(argv[optind + 1]));
+		replay_file = argv[optind + 1];
+		optind = argc;
+	}
+
+	if (optind < argc && streq(argv[optind], "status")) {
+		if (argc - optind != 1)
+			fatal("usage: revoco status");
+		exit(show_status());
 	}
 
-	if (handle == -1) {
-		char buf[128];
-		int i, fd;
+	/* revoco provision PROFILE */
+	if (optind < argc && streq(argv[optind], "provision")) {
+		if (argc - optind != 2)
+			fatal("usage: revoco provision PROFILE");
+		if (daemon_mode || watch_mode || recfile)
+			fatal("provision runs on its own");
+		exit(provision(argv[optind + 1]));
+	}
 
-		for (i = 0; i < 16; ++i) {
-			sprintf(buf, "/dev/hidraw%d", i);
-			fd = open(buf, O_RDWR);
-			if (fd >= 0)
-			{
-				if (debug > 1)
-					printf("Trying %s\n", buf);
+	/* revoco watch battery[=SECONDS] */
+	if (optind < argc && streq(argv[optind], "watch")) {
+		char *arg = argc - optind == 2 ? argv[optind + 1] : "";
+
+		if (streq(arg, "battery"))
+			battery_interval = 60;
+		else if (strneq(arg, "battery=", 8))
+			battery_interval = atoi(arg + 8);
+		if (battery_interval <= 0)
+			fatal("usage: revoco watch battery[=SECONDS]");
+		optind = argc;
+	}
 
-				if (check_dev(fd) == fd) {
-					handle = fd;
-					break;
-				}
-				close(fd);
-			}
-		}
+	/* revoco stress [MAX] */
+	if (optind < argc && streq(argv[optind], "stress")) {
+		stress_max = argc - optind == 2 ? atoi(argv[optind + 1]) :
+			     argc - optind == 1 ? STRESS_MAX : 0;
+		if (stress_max < STRESS_FIRST)
+			fatal("usage: revoco stress [MAX], MAX at least %d",
+			      STRESS_FIRST);
+		optind = argc;
 	}
 
-	if (handle == -1)
-		trouble_shooting();
+	/* reject a bad command line before talking to anything */
+	--optind;
+	compile(&plan, argc-optind, argv+optind);
+
+	if (daemon_mode && (replay_file || battery_interval || stress_max))
+		fatal("the daemon only serves commands");
+
+	if (watch_mode) {
+		if (!plan.n)
+			fatal("--watch needs commands to apply");
+		if (daemon_mode || recfile || replay_file || battery_interval ||
+		    stress_max)
+			fatal("--watch applies commands on its own");
+		watch(&plan, apply);
+		exit(0);
+	}
 
-	init_dev(handle);
+	/* hand the verbs to a running daemon unless told to use a device */
+	if (!daemon_mode && !all && !ndevs && !recfile && plan.n) {
+		int status = client(sockname, argc-optind-1, argv+optind+1);
 
-	if (optind < argc) {
-		--optind;
-		configure(handle, argc-optind, argv+optind);
+		if (status >= 0)
+			exit(status);
 	}
 
-	close_dev(handle);
-	exit(0);
+	if (all && !ndevs) {
+		all_devs();
+		if (!ndevs)
+			trouble_shooting(NULL);
+	}
+
+	if ((all || ndevs > 1) &&
+	    (recfile || replay_file || battery_interval || stress_max))
+		fatal("record, replay, watch and stress take a single receiver");
+
+	if (daemon_mode) {
+		daemon_open(recfile);
+		daemon_run(sockname);
+		exit(0);
+	}
+
+	if (all || ndevs > 1)
+		exit(fan_out(&plan));
+
+	mx_init(&dev);
+	dev.debug = debug;
+	dev.timeout = timeout;
+	dev.force = force;
+	if (recfile && mx_record(&dev, recfile) < 0)
+		fatal("%s: %s", recfile, strerror(errno));
+	if ((!ndevs || mx_open(&dev, devs[0]) < 0) && mx_find(&dev) < 0)
+		trouble_shooting(&dev);
+
+	if (replay_file)
+		status = replay(&dev, replay_file);
+	else if (battery_interval)
+		status = watch_battery(&dev, battery_interval);
+	else if (stress_max)
+		status = stress(&dev, stress_max);
+	else
+		status = configure(&dev, &plan);
+	if (stats)
+		mx_print_stats(&dev);
+
+	mx_plan_free(&plan);
+	mx_close(&dev);
+	mx_record_stop(&dev);
+	exit(status);
 }
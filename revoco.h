@@ -0,0 +1,305 @@
+/*
+ * librevoco - HID++ access to Logitech receivers through hidraw.
+ *
+ * Everything about one receiver lives in a struct mx_dev.  The calls
+ * either block until the device answers (mx_query(), mx_query_many()),
+ * or are driven from the caller's own event loop: poll mx_fd() for
+ * input with mx_timeout() as the timeout, and call mx_process() when
+ * it fires; queries handed to mx_submit() complete from there.
+ */
+#ifndef REVOCO_H
+#define REVOCO_H
+
+#include <stdatomic.h>
+
+typedef unsigned char u8;
+typedef signed short s16;
+typedef signed int s32;
+typedef unsigned int u32;
+
+#define LOGITECH	(short)0x046d
+#define MX_REVOLUTION	(short)0xc51a	// version RR41.01_B0025
+#define MX_REVOLUTION2	(short)0xc525	// version RQR02.00_B0020
+#define MX_REVOLUTION3	(short)0xc526	// don't know which version this is
+#define MX_REVOLUTION4	(short)0xc52b	// Unifying Receiver (added 2015-05-30)
+#define MX_REVOLUTION5	(short)0xb007	// ??? R0019 (added 2015-05-30)
+#define MX_5500		(short)0xc71c	// keyboard/mouse combo - experimental
+
+#define RING_SIZE	64	/* power of two */
+#define REPORT_SHORT	7	/* report 0x10 */
+#define REPORT_LONG	20	/* report 0x11 */
+#define REPORT_MAX	REPORT_LONG
+#define LONG_VAL	16	/* value of a long register (0x82, 0x83) */
+#define SHADOW_MAX	8
+#define INFLIGHT_MAX	32
+#define HIST_MAX	24	/* up to 2^24us, about 16s */
+#define FEATURE_MAX	16
+#define SLOT_MAX	6	/* devices paired to a Unifying receiver */
+#define PROTO_MAX	8	/* device indexes 1-7 can speak HID++ 2.0 */
+
+/* HID++ 2.0 features */
+#define FEAT_ROOT		0x0000
+#define FEAT_BATTERY		0x1000
+#define FEAT_UNIFIED_BATTERY	0x1004
+#define FEAT_SMARTSHIFT		0x2110
+#define FEAT_NONE		0xffff	/* none of them will do */
+
+struct mx_dev;
+
+struct report {
+	u8 len;			/* 0 once consumed */
+	u8 data[REPORT_MAX];
+};
+
+/* where a device keeps a HID++ 2.0 feature, see mx_features() */
+struct mx_feature {
+	u8 idx;			/* device index */
+	u8 index;		/* 0 if the device does not have it */
+	unsigned short id;	/* FEAT_* */
+};
+
+/* a slot of the receiver's pairing table, see mx_pairings() */
+struct mx_pairing {
+	u8 slot;		/* device index, 1-6 */
+	u8 kind;		/* 1 keyboard, 2 mouse, ...; 0 if free */
+	unsigned short wpid;	/* wireless product id */
+	char name[16];
+};
+
+/* last value read from or written to a register */
+struct shadow {
+	u8 reg;
+	u8 valid;
+	u8 val[3];
+};
+
+/*
+ * A register access in flight.  The reply is matched to it by (device
+ * index, sub-id, register); an error reply (sub-id 0x8f) carries the
+ * failed sub-id and register in place of them.  Long register writes
+ * (sub-id 0x82) go out as report 0x11, long reads (0x83) come back as
+ * one; everything else fits the short report 0x10.
+ *
+ * A HID++ 2.0 call is a query too, with the feature index as sub-id and
+ * the function and software id as register (mx_submit() picks the
+ * latter); its errors come as sub-id 0xff.
+ */
+struct query {
+	u8 idx, sub, reg;
+	u8 val[LONG_VAL];	/* value written, 3 bytes unless sub is 0x82 */
+	u8 state;		/* Q_* */
+	u8 len;			/* of the reply in res[] */
+	u8 res[REPORT_MAX - 1];	/* reply without the report id */
+	u8 tries;
+	long long start, sent, expires, deadline;
+
+	/* called when the state leaves Q_PENDING, may be NULL */
+	void (*done)(struct mx_dev *dev, struct query *q);
+	void *arg;
+};
+
+#define Q_PENDING	0
+#define Q_DONE		1
+#define Q_ERROR		2
+#define Q_TIMEOUT	3
+
+/* what became of the commands of one kind, see mx_print_stats() */
+struct mx_stat {
+	unsigned n, errors, timeouts, retries;
+	unsigned hist[HIST_MAX];	/* bucket i: below 2^(i+1) us */
+	long long total;		/* microseconds, of those that worked */
+};
+
+#define S_SET		0	/* register write */
+#define S_GET		1	/* register read */
+#define S_RECONNECT	2
+#define S_RAW		3
+#define S_MAX		4
+
+/*
+ * Traffic log written by mx_record(): REC_MAGIC, then for each report
+ * sent or received a frame of REC_HDR bytes, the mx_now() time (8 bytes,
+ * host order), REC_TX or REC_RX and the length, followed by the report.
+ */
+#define REC_MAGIC	"revoco\x01\n"
+#define REC_MAGIC_LEN	8
+#define REC_HDR		10
+#define REC_TX		0
+#define REC_RX		1
+#define REC_BUF		65536
+
+struct mx_dev {
+	int fd;
+	u8 idx;			/* device index, first byte of HID++ messages */
+	short product;
+	char path[64];
+
+	int debug;
+	int timeout;		/* per command, in milliseconds */
+	int force;		/* write even what the shadow says is there */
+
+	/* round trip estimate, see rto() */
+	long long srtt, rttvar;
+
+	/* receive ring, see rx_fill() */
+	struct report ring[RING_SIZE];
+	unsigned ring_head, ring_tail;
+	void (*input_handler)(struct mx_dev *dev, const u8 *rep, int len);
+	void (*notify_handler)(struct mx_dev *dev, const u8 *rep, int len);
+
+	struct query *inflight[INFLIGHT_MAX];
+	int ninflight;
+
+	struct shadow shadow[SHADOW_MAX];
+
+	/* HID++ 2.0, see mx_features() */
+	u8 proto[PROTO_MAX];	/* by device index: 0 unknown, 1 or 2 */
+	struct mx_feature feat[FEATURE_MAX];
+	int nfeat, feat_loaded;
+
+	/* counters */
+	unsigned tx, rx, rx_input, rx_notify, skipped;
+	struct mx_stat stat[S_MAX];
+
+	/* traffic log, see mx_record() */
+	int rec_fd;
+	u8 *rec_buf;
+	unsigned rec_len;
+};
+
+/*
+ * A command line compiled into steps before any of it is sent, so that a
+ * typo anywhere rejects the whole command.  Consecutive register steps
+ * run as one pipelined batch.
+ */
+#define V_WHEEL		0	/* free, click, manual, auto, soft-* */
+#define V_RECONNECT	1
+#define V_MODE		2
+#define V_BATTERY	3
+#define V_DUMP		4	/* one step per register */
+#define V_RAW		5
+#define V_RECV		6	/* the "query" debug verb */
+#define V_SLEEP		7
+#define V_STATS		8	/* print mx_print_stats() */
+#define V_LIST		9	/* print the pairing table */
+
+#define DUMP_MAX	16
+#define RAW_MAX		64
+
+struct mx_step {
+	u8 verb;		/* V_* */
+	u8 idx;			/* device index, 0 for the device's own */
+	u8 arg;			/* seconds to sleep, report id to wait for */
+	u8 len;			/* length of data[] */
+	u8 data[RAW_MAX];	/* raw report sent or received */
+	struct query q;		/* register access */
+
+	/* the HID++ 2.0 call that stands in for q, if feature is set */
+	unsigned short feature;
+	struct query call;
+};
+
+struct mx_plan {
+	int n, size;
+	struct mx_step *step;
+};
+
+/*
+ * Status published by the daemon in a shared memory segment, so that any
+ * number of programs can read it without a syscall, let alone a round
+ * trip to the mouse.  Writers make `seq' odd while they update it; see
+ * mx_status_read().
+ */
+#define STATUS_SHM	"/revoco-%u"	/* shm_open() name, %u is the uid */
+#define STATUS_MAGIC	0x7265766fu
+#define STATUS_MAX	8
+
+struct mx_status_dev {
+	char path[64];
+	u8 battery;		/* percent */
+	u8 state;		/* register 0x0d state byte, 0 if unknown */
+	u8 mode;		/* register 0x08: 1 click-by-click, 0 free */
+	u8 mode_known;
+	long long updated;	/* wall clock, microseconds since 1970 */
+};
+
+struct mx_status {
+	u32 magic;
+	_Atomic u32 seq;
+	u32 n;
+	struct mx_status_dev dev[STATUS_MAX];
+};
+
+/* device discovery */
+u8 mx_index(short vendor, short product);
+int mx_scan(int debug, int (*found)(const char *path, void *arg), void *arg);
+void mx_init(struct mx_dev *dev);
+int mx_open(struct mx_dev *dev, const char *path);
+int mx_find(struct mx_dev *dev);
+void mx_close(struct mx_dev *dev);
+int mx_check(const char *node);
+int mx_serial(struct mx_dev *dev, char *buf, int n);
+void mx_select(struct mx_dev *dev, u8 idx);
+void mx_forget(struct mx_dev *dev);
+int mx_pairings(struct mx_dev *dev, struct mx_pairing *p);
+
+/* identity cache, see mx_find() */
+void mx_cache_drop(void);
+int mx_cache_watch(void);
+int mx_cache_event(int fd);
+
+/* hotplug */
+#define HP_ADD		1
+#define HP_REMOVE	2
+
+int mx_hotplug_open(void);
+int mx_hotplug_read(int fd, char *path, int n);
+
+/* raw reports, starting with the report id */
+int mx_report_len(u8 id);
+int mx_send(struct mx_dev *dev, const u8 *rep, int n);
+int mx_recv(struct mx_dev *dev, u8 *buf, int n, long long wait);
+
+/* HID++ register access */
+int mx_cmd(struct mx_dev *dev, u8 b1, u8 b2, u8 b3);
+int mx_query(struct mx_dev *dev, u8 reg, u8 *res);
+int mx_query_many(struct mx_dev *dev, struct query *q, int n);
+
+/* command plans */
+int mx_plan_compile(struct mx_plan *plan, int argc, char **argv);
+int mx_plan_run(struct mx_dev *dev, struct mx_plan *plan, int first);
+void mx_plan_free(struct mx_plan *plan);
+
+/* HID++ 2.0 */
+int mx_features(struct mx_dev *dev, u8 idx, const unsigned short *ids, int n);
+int mx_feature_index(struct mx_dev *dev, u8 idx, unsigned short id);
+int mx_call(struct mx_dev *dev, u8 idx, unsigned short id, u8 func,
+	    const u8 *params, int n, u8 *res);
+
+/* non-blocking use */
+int mx_fd(struct mx_dev *dev);
+int mx_submit(struct mx_dev *dev, struct query *q);
+void mx_cancel(struct mx_dev *dev, struct query *q);
+int mx_process(struct mx_dev *dev);
+int mx_timeout(struct mx_dev *dev);
+int mx_flush(struct mx_dev *dev);
+
+/* status segment, written by the daemon */
+struct mx_status *mx_status_create(void);
+void mx_status_publish(struct mx_status *st, int i, const struct mx_status_dev *d);
+void mx_status_remove(struct mx_status *st);
+const struct mx_status *mx_status_open(void);
+int mx_status_read(const struct mx_status *st, struct mx_status_dev *d, int n);
+
+/* command line arguments */
+int mx_twoargs(const char *str, u8 *arg1, u8 *arg2, int def, int min, int max);
+int mx_nargs(const char *str, u8 *buf, int n, int def, int min, int max);
+const char *mx_strerror(void);
+
+long long mx_now(void);
+void mx_print_stats(struct mx_dev *dev);
+int mx_record(struct mx_dev *dev, const char *path);
+int mx_record_flush(struct mx_dev *dev);
+void mx_record_stop(struct mx_dev *dev);
+
+#endif